@@ -6,9 +6,12 @@
 #include "elog.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -19,20 +22,49 @@
 #define ELOG_FACILITY 3 // LOG_DAEMON
 #endif
 
+// Room for the message plus the prefix and timestamp
+#define ELOG_LINE_MAX (ELOG_MSG_MAX + 64)
+
+// Largest body for elog_pmsg_dump()
+#define ELOG_PMSG_DUMP_MAX 4096
+
+// Rate limiting
+//
+// Each call site gets a token bucket that allows a burst of messages and then
+// one every ELOG_LIMIT_INTERVAL_MS. Call sites are identified by format
+// string and severity and hashed into a small table. Collisions just replace
+// the old entry. Once an entry's interval is up, a summary with the number of
+// suppressed messages is logged.
+#define ELOG_LIMIT_SLOTS       16
+#define ELOG_LIMIT_BURST       5
+#define ELOG_LIMIT_INTERVAL_MS 10000
+
+struct elog_limit {
+    const char *fmt;
+    int severity;
+    int tokens;
+    unsigned int suppressed;
+    uint64_t refill_ms;
+};
+
+static struct elog_limit limits[ELOG_LIMIT_SLOTS];
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int elog_level = ELOG_LEVEL_INFO;
+int elog_pmsg_format = ELOG_PMSG_TEXT;
 
-static int kmsg_format(int severity, char **strp, const char *msg)
+static int kmsg_format(int severity, char *str, const char *msg)
 {
     int prival = ELOG_FACILITY * 8 + (severity & ELOG_SEVERITY_MASK);
-    return asprintf(strp, "<%d>" PROGRAM_NAME ": %s\n", prival, msg);
+    return snprintf(str, ELOG_LINE_MAX, "<%d>" PROGRAM_NAME ": %s\n", prival, msg);
 }
 
-static int stderr_format(char **strp, const char *msg)
+static int stderr_format(char *str, const char *msg)
 {
-    return asprintf(strp, PROGRAM_NAME ": %s\n", msg);
+    return snprintf(str, ELOG_LINE_MAX, PROGRAM_NAME ": %s\n", msg);
 }
 
-static int pmsg_format(char **strp, const char *msg)
+static int pmsg_format(char *str, const char *msg)
 {
     struct timespec ts;
     if (clock_gettime(CLOCK_REALTIME, &ts) != 0)
@@ -46,8 +78,9 @@ static int pmsg_format(char **strp, const char *msg)
 
     // Match the RFC3339 timestamps from Erlang's logger_formatter
     // 2025-12-04T00:01:34.200744+00:00
-    return asprintf(
-            strp,
+    return snprintf(
+            str,
+            ELOG_LINE_MAX,
             "%04d-%02d-%02dT%02d:%02d:%02d.%06ld+00:00 " PROGRAM_NAME " %s\n",
             tm.tm_year + 1900,
             tm.tm_mon + 1,
@@ -60,71 +93,418 @@ static int pmsg_format(char **strp, const char *msg)
         );
 }
 
-static void log_pmsg_breadcrumb(const char *msg)
+// snprintf returns the untruncated length, so clip it to what's in the buffer
+static int clip_len(int len)
+{
+    return len < ELOG_LINE_MAX ? len : ELOG_LINE_MAX - 1;
+}
+
+static int open_pmsg()
 {
     static int open_failed = 0;
 
     // Don't bother trying again on failures.
     if (open_failed)
-        return;
+        return -1;
 
     int pmsg_fd = open("/dev/pmsg0", O_WRONLY | O_CLOEXEC);
-    if (pmsg_fd < 0) {
+    if (pmsg_fd < 0)
         open_failed = 1;
+    return pmsg_fd;
+}
+
+static void log_pmsg_breadcrumb(const char *msg)
+{
+    int pmsg_fd = open_pmsg();
+    if (pmsg_fd < 0)
         return;
-    }
 
-    char *str;
-    int len = pmsg_format(&str, msg);
+    char str[ELOG_LINE_MAX];
+    int len = pmsg_format(str, msg);
     if (len > 0) {
-        ssize_t ignore = write(pmsg_fd, str, len);
+        ssize_t ignore = write(pmsg_fd, str, clip_len(len));
+        (void) ignore;
+    }
+    close(pmsg_fd);
+}
+
+// Binary pmsg breadcrumbs
+//
+// Text breadcrumbs are 80-200 bytes and pstore's pmsg region can be as small
+// as 4 KB. Binary breadcrumbs store a hash of the format string and the raw
+// arguments instead. tools/pmsg_decode.c turns them back into text by hashing
+// the strings in the heart executable. Each record is:
+//
+//   0xfe             Sync byte. This never appears in UTF-8 text from other
+//                    pmsg writers.
+//   length           Varint length of the body
+//   body:
+//     event id       Varint of the FNV-1a hash of the format string folded to
+//                    16 bits. 0 is a start record.
+//     delta time     Varint milliseconds since the previous record
+//     arguments      Zigzag varints for signed integers, varints for unsigned
+//                    integers, and a varint length and bytes for strings
+//   crc8             CRC-8 (polynomial 0x07) of the body
+//
+// The first record from a heart process is a start record with the wall clock
+// time as varint seconds and microseconds so that times can be recovered.
+#define ELOG_PMSG_SYNC       0xfe
+#define ELOG_BINARY_MAX      ELOG_MSG_MAX
+#define ELOG_BINARY_STR_MAX  64
+
+struct binary_record {
+    uint8_t body[ELOG_BINARY_MAX];
+    size_t len;
+    int truncated;
+};
+
+static void put_varint(struct binary_record *r, uint64_t v)
+{
+    do {
+        uint8_t b = v & 0x7f;
+        v >>= 7;
+        if (v)
+            b |= 0x80;
+        if (r->len < sizeof(r->body))
+            r->body[r->len++] = b;
+        else
+            r->truncated = 1;
+    } while (v);
+}
+
+static void put_zigzag(struct binary_record *r, int64_t v)
+{
+    put_varint(r, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63));
+}
+
+static void put_bytes(struct binary_record *r, const void *data, size_t len)
+{
+    if (r->len + len > sizeof(r->body)) {
+        r->truncated = 1;
+        return;
+    }
+    memcpy(&r->body[r->len], data, len);
+    r->len += len;
+}
+
+static uint16_t elog_event_id(const char *fmt)
+{
+    uint32_t hash = 2166136261u;
+    while (*fmt) {
+        hash ^= (uint8_t) *fmt++;
+        hash *= 16777619u;
+    }
+    uint16_t id = (hash >> 16) ^ (hash & 0xffff);
+    return id != 0 ? id : 1;
+}
+
+static uint8_t crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+    }
+    return crc;
+}
+
+// Walk the format string like printf does and append each argument
+static void put_args(struct binary_record *r, const char *fmt, va_list ap)
+{
+    while ((fmt = strchr(fmt, '%')) != NULL) {
+        fmt++;
+        if (*fmt == '%') {
+            fmt++;
+            continue;
+        }
+
+        fmt += strspn(fmt, "-+ #0'");
+        if (*fmt == '*') {
+            put_zigzag(r, va_arg(ap, int));
+            fmt++;
+        } else {
+            fmt += strspn(fmt, "0123456789");
+        }
+        if (*fmt == '.') {
+            fmt++;
+            if (*fmt == '*') {
+                put_zigzag(r, va_arg(ap, int));
+                fmt++;
+            } else {
+                fmt += strspn(fmt, "0123456789");
+            }
+        }
+
+        int longs = 0;
+        int size_t_arg = 0;
+        for (;; fmt++) {
+            if (*fmt == 'l')
+                longs++;
+            else if (*fmt == 'z' || *fmt == 't' || *fmt == 'j')
+                size_t_arg = 1;
+            else if (*fmt != 'h')
+                break;
+        }
+
+        switch (*fmt) {
+        case 'd':
+        case 'i':
+            if (longs >= 2)
+                put_zigzag(r, va_arg(ap, long long));
+            else if (longs == 1 || size_t_arg)
+                put_zigzag(r, va_arg(ap, long));
+            else
+                put_zigzag(r, va_arg(ap, int));
+            break;
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+            if (longs >= 2)
+                put_varint(r, va_arg(ap, unsigned long long));
+            else if (longs == 1 || size_t_arg)
+                put_varint(r, va_arg(ap, unsigned long));
+            else
+                put_varint(r, va_arg(ap, unsigned int));
+            break;
+        case 'c':
+            put_varint(r, (unsigned char) va_arg(ap, int));
+            break;
+        case 'p':
+            put_varint(r, (uintptr_t) va_arg(ap, void *));
+            break;
+        case 's': {
+            const char *str = va_arg(ap, const char *);
+            if (!str)
+                str = "(null)";
+            size_t len = strnlen(str, ELOG_BINARY_STR_MAX);
+            put_varint(r, len);
+            put_bytes(r, str, len);
+            break;
+        }
+        default:
+            // Heart doesn't log anything else. Stop since the arguments are unknown.
+            return;
+        }
+        fmt++;
+    }
+}
+
+static uint64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int binary_record_to_pmsg(const struct binary_record *r, uint8_t *out)
+{
+    int len = 0;
+    out[len++] = ELOG_PMSG_SYNC;
+
+    size_t body_len = r->len;
+    do {
+        uint8_t b = body_len & 0x7f;
+        body_len >>= 7;
+        out[len++] = body_len ? (b | 0x80) : b;
+    } while (body_len);
+
+    memcpy(&out[len], r->body, r->len);
+    len += r->len;
+    out[len++] = crc8(r->body, r->len);
+    return len;
+}
+
+// The pet thread logs too. The lock keeps the delta times in the order that
+// the records are written.
+static pthread_mutex_t binary_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t binary_last_ms = 0;
+static int binary_started = 0;
+
+static void log_pmsg_binary(int pmsg_fd, const char *fmt, va_list ap)
+{
+    uint8_t out[ELOG_BINARY_MAX + 8];
+    struct binary_record r;
+
+    pthread_mutex_lock(&binary_lock);
+    uint64_t now_ms = monotonic_ms();
+
+    if (!binary_started) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        r.len = 0;
+        r.truncated = 0;
+        put_varint(&r, 0);
+        put_varint(&r, 0);
+        put_varint(&r, (uint64_t) ts.tv_sec);
+        put_varint(&r, (uint64_t) (ts.tv_nsec / 1000));
+
+        ssize_t ignore = write(pmsg_fd, out, binary_record_to_pmsg(&r, out));
+        (void) ignore;
+
+        binary_last_ms = now_ms;
+        binary_started = 1;
+    }
+
+    r.len = 0;
+    r.truncated = 0;
+    put_varint(&r, elog_event_id(fmt));
+    put_varint(&r, now_ms - binary_last_ms);
+    put_args(&r, fmt, ap);
+    binary_last_ms = now_ms;
+
+    // Drop records that didn't fit rather than writing something undecodable
+    if (!r.truncated) {
+        ssize_t ignore = write(pmsg_fd, out, binary_record_to_pmsg(&r, out));
+        (void) ignore;
+    }
+    pthread_mutex_unlock(&binary_lock);
+}
+
+void elog_pmsg_dump(const char *title, const char *body, size_t len)
+{
+    static char str[ELOG_LINE_MAX + ELOG_PMSG_DUMP_MAX];
+
+    int pmsg_fd = open_pmsg();
+    if (pmsg_fd < 0)
+        return;
+
+    int title_len = pmsg_format(str, title);
+    if (title_len > 0) {
+        title_len = clip_len(title_len);
+        if (len > ELOG_PMSG_DUMP_MAX)
+            len = ELOG_PMSG_DUMP_MAX;
+        memcpy(str + title_len, body, len);
+
+        ssize_t ignore = write(pmsg_fd, str, title_len + len);
         (void) ignore;
-        free(str);
     }
     close(pmsg_fd);
 }
 
 static void log_write(int severity, const char *msg)
 {
-    char *str;
+    char str[ELOG_LINE_MAX];
     ssize_t ignore;
     int log_fd = open("/dev/kmsg", O_WRONLY | O_CLOEXEC);
     if (log_fd >= 0) {
-        int len = kmsg_format(severity, &str, msg);
-        if (len > 0) {
-            ignore = write(log_fd, str, len);
-            free(str);
-        }
+        int len = kmsg_format(severity, str, msg);
+        if (len > 0)
+            ignore = write(log_fd, str, clip_len(len));
         close(log_fd);
     } else {
-        int len = stderr_format(&str, msg);
-        if (len > 0) {
-            ignore = write(STDERR_FILENO, str, len);
-            free(str);
-        }
+        int len = stderr_format(str, msg);
+        if (len > 0)
+            ignore = write(STDERR_FILENO, str, clip_len(len));
     }
     (void) ignore;
 }
 
-void elog(int severity, const char *fmt, ...)
+static void elog_vwrite(int severity, const char *fmt, va_list ap)
 {
     int level = severity & ELOG_SEVERITY_MASK;
     int log_pmsg = severity & ELOG_PMSG;
     if (level <= elog_level || log_pmsg) {
-        va_list ap;
-        va_start(ap, fmt);
+        if (log_pmsg && elog_pmsg_format == ELOG_PMSG_BINARY) {
+            int pmsg_fd = open_pmsg();
+            if (pmsg_fd >= 0) {
+                va_list binary_ap;
+                va_copy(binary_ap, ap);
+                log_pmsg_binary(pmsg_fd, fmt, binary_ap);
+                va_end(binary_ap);
+                close(pmsg_fd);
+            }
+            log_pmsg = 0;
+        }
 
-        char *msg;
-        if (vasprintf(&msg, fmt, ap) > 0) {
+        // Format on the stack so that logging never touches the heap
+        char msg[ELOG_MSG_MAX];
+        if ((level <= elog_level || log_pmsg) && vsnprintf(msg, sizeof(msg), fmt, ap) > 0) {
             if (log_pmsg)
                 log_pmsg_breadcrumb(msg);
 
             if (level <= elog_level)
                 log_write(severity, msg);
+        }
+    }
+}
+
+static void elog_summary(int severity, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void elog_summary(int severity, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    elog_vwrite(severity, fmt, ap);
+    va_end(ap);
+}
+
+static void log_suppressed(const struct elog_limit *limit)
+{
+    elog_summary(limit->severity, "suppressed %u repeats of '%.80s'", limit->suppressed, limit->fmt);
+}
 
-            free(msg);
+// Returns 1 if the message should be logged. Summaries for call sites that
+// were limited are logged here too since there's no timer to do it.
+static int elog_allowed(int severity, const char *fmt)
+{
+    struct elog_limit *limit = &limits[((uintptr_t) fmt >> 2) % ELOG_LIMIT_SLOTS];
+    struct elog_limit summaries[ELOG_LIMIT_SLOTS];
+    int summary_count = 0;
+    int allowed;
+    uint64_t now_ms = monotonic_ms();
+
+    pthread_mutex_lock(&limit_lock);
+    if (limit->fmt != fmt || limit->severity != severity) {
+        if (limit->suppressed)
+            summaries[summary_count++] = *limit;
+
+        limit->fmt = fmt;
+        limit->severity = severity;
+        limit->tokens = ELOG_LIMIT_BURST;
+        limit->suppressed = 0;
+        limit->refill_ms = now_ms + ELOG_LIMIT_INTERVAL_MS;
+    }
+
+    for (int i = 0; i < ELOG_LIMIT_SLOTS; i++) {
+        struct elog_limit *l = &limits[i];
+        if (l->fmt && now_ms >= l->refill_ms) {
+            uint64_t intervals = (now_ms - l->refill_ms) / ELOG_LIMIT_INTERVAL_MS + 1;
+            if (intervals >= (uint64_t) (ELOG_LIMIT_BURST - l->tokens))
+                l->tokens = ELOG_LIMIT_BURST;
+            else
+                l->tokens += (int) intervals;
+            l->refill_ms += intervals * ELOG_LIMIT_INTERVAL_MS;
+            if (l->suppressed) {
+                summaries[summary_count++] = *l;
+                l->suppressed = 0;
+            }
         }
+    }
+
+    allowed = limit->tokens > 0;
+    if (allowed)
+        limit->tokens--;
+    else
+        limit->suppressed++;
+    pthread_mutex_unlock(&limit_lock);
 
+    for (int i = 0; i < summary_count; i++)
+        log_suppressed(&summaries[i]);
+
+    return allowed;
+}
+
+void elog_write(int severity, const char *fmt, ...)
+{
+    int level = severity & ELOG_SEVERITY_MASK;
+    if ((level <= elog_level || (severity & ELOG_PMSG)) && elog_allowed(severity, fmt)) {
+        va_list ap;
+        va_start(ap, fmt);
+        elog_vwrite(severity, fmt, ap);
         va_end(ap);
     }
 }
@@ -6,6 +6,8 @@
 #ifndef ELOG_H
 #define ELOG_H
 
+#include <stddef.h>
+
 // See /usr/include/syslog.h for values. They're also standardized in RFC5424.
 #define ELOG_LEVEL_EMERG   0
 #define ELOG_LEVEL_ALERT   1
@@ -31,11 +33,36 @@
 #define ELOG_DEBUG     (ELOG_LEVEL_DEBUG)
 #define ELOG_PMSG_ONLY (ELOG_LEVEL_DONT_LOG | ELOG_PMSG)
 
+// Messages less severe than this are compiled out. Pmsg breadcrumbs are
+// always kept. Small builds set this to ELOG_LEVEL_ERROR.
+#ifndef ELOG_MAX_LEVEL
+#define ELOG_MAX_LEVEL ELOG_LEVEL_DEBUG
+#endif
+
+// Longest log message. Longer ones are truncated.
+#define ELOG_MSG_MAX 256
+
 // Global logging level
 extern int elog_level;
 
+// Pmsg breadcrumb formats. See elog.c for the binary format.
+#define ELOG_PMSG_TEXT   0
+#define ELOG_PMSG_BINARY 1
+
+extern int elog_pmsg_format;
+
 // Logging functions
-void elog(int severity, const char *fmt, ...)
+#define elog(severity, ...) \
+    do { \
+        if (((severity) & ELOG_SEVERITY_MASK) <= ELOG_MAX_LEVEL || ((severity) & ELOG_PMSG)) \
+            elog_write((severity), __VA_ARGS__); \
+    } while (0)
+
+void elog_write(int severity, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
 
+// Write a title line and a multi-line body to pmsg in one write. This is
+// always text.
+void elog_pmsg_dump(const char *title, const char *body, size_t len);
+
 #endif // ELOG_H
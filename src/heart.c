@@ -62,8 +62,10 @@
  *
  *  BLOCKING DESCRIPTORS
  *
- *  All file descriptors in this program are blocking. This can lead
- *  to deadlocks. The emulator reads and writes are blocking.
+ *  Reads from the emulator are blocking. Writes to it are queued and
+ *  standard output is non-blocking so that an emulator that stops reading
+ *  can't stop this program from petting the hardware watchdog. If the queue
+ *  fills up, messages are dropped.
  *
  *  STANDARD INPUT, OUTPUT AND ERROR
  *
@@ -81,8 +83,12 @@
  *
  */
 
+#define _GNU_SOURCE /* for CPU_SET and pthread_setaffinity_np */
+
 #include <stdio.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <stdarg.h>
@@ -92,18 +98,28 @@
 #include <errno.h>
 
 #include <signal.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <linux/reboot.h>
 #include <sys/reboot.h>
 #include <arpa/inet.h>
 #include <linux/watchdog.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "elog.h"
+#include "probes.h"
 
 #define PROGRAM_NAME "nerves_heart"
 #ifndef PROGRAM_VERSION
@@ -128,11 +144,28 @@
 #define HEART_WATCHDOG_PATH        "HEART_WATCHDOG_PATH"
 #define HEART_NO_KILL              "HEART_NO_KILL"
 #define HEART_VERBOSE              "HEART_VERBOSE"
+#define HEART_PMSG_FORMAT          "HEART_PMSG_FORMAT"
+#define HEART_HARDENED             "HEART_HARDENED"
+#define HEART_OOM_SCORE_ADJ        "HEART_OOM_SCORE_ADJ"
+#define HEART_PET_THREAD_PRIORITY  "HEART_PET_THREAD_PRIORITY"
+#define HEART_PET_THREAD_CPU       "HEART_PET_THREAD_CPU"
+#define HEART_PSI_THRESHOLD        "HEART_PSI_THRESHOLD"
+#define HEART_PSI_DURATION         "HEART_PSI_DURATION"
+#define HEART_GAP_WARNING_PERCENT  "HEART_GAP_WARNING_PERCENT"
+#define HEART_LEDGER_PATH          "HEART_LEDGER_PATH"
+#define HEART_BOOT_TIMES_PATH      "HEART_BOOT_TIMES_PATH"
+#define HEART_LOW_POWER            "HEART_LOW_POWER"
+#define HEART_TIMER_SLACK_MS       "HEART_TIMER_SLACK_MS"
+#define HEART_KEXEC                "HEART_KEXEC"
+#define HEART_GUARDED_TIMEOUT      "HEART_GUARDED_TIMEOUT"
+#define HEART_ADAPTIVE_PET         "HEART_ADAPTIVE_PET"
+#define HEART_PET_HYSTERESIS       "HEART_PET_HYSTERESIS"
+#define HEART_REEXEC_STATE         "HEART_REEXEC_STATE" /* Set by heart for the new image */
 
 #define MSG_HDR_SIZE         (2)
 #define MSG_HDR_PLUS_OP_SIZE (3)
-#define MSG_BODY_SIZE        (2048)
-#define MSG_TOTAL_SIZE       (2050)
+#define MSG_BODY_SIZE        (4096)
+#define MSG_TOTAL_SIZE       (4098)
 
 struct msg {
   unsigned short len;
@@ -163,6 +196,68 @@ struct msg {
 #define  MIN_RUN_TIME               60
 #define  MAX_MIN_RUN_TIME           600 /* Don't allow the heart to be disabled indefinitely */
 
+/* Adaptive pet interval */
+#define  MIN_WDT_PET_MARGIN_MS      2000 /* Always pet at least this long before the WDT expires */
+#define  PET_TIMER_RESOLUTION_MS    1000 /* Pets are scheduled in whole seconds, so they can be this late */
+#define  DEFAULT_PET_HYSTERESIS     2 /* Seconds that the pet interval has to grow by before changing it */
+#define  WDT_DRIFT_WARNING_PPM      20000 /* Warn if the WDT counts down 2% faster than it says */
+
+/* Hardened mode */
+#define  DEFAULT_OOM_SCORE_ADJ      -1000 /* Never pick heart when out of memory */
+#define  STACK_PREFAULT_SIZE        (64 * 1024) /* Much more than heart's deepest call */
+
+/* Pet thread */
+#define  PET_THREAD_STACK_SIZE      (64 * 1024) /* Keep small since mlockall locks all of it */
+
+/* Threads for writes and syncs that might get stuck on storage */
+#define  STORAGE_THREAD_STACK_SIZE  (64 * 1024)
+
+/* Pressure stall information (PSI) */
+#define  PSI_WINDOW_US              10000000 /* Longest PSI trigger window the kernel allows */
+#define  PSI_STALL_GAP              20 /* Stall is over if no trigger fires for two windows */
+#define  DEFAULT_PSI_DURATION       120
+#define  MAX_PSI_DURATION           3600
+
+/* Erlang VM monitoring */
+#define  VM_SAMPLE_INTERVAL         10 /* Don't sample the VM's /proc files more often than this */
+#define  VM_RSS_GROWTH_WINDOW       3600 /* Average RSS growth over about an hour */
+#define  VM_MAX_THREADS             256 /* Threads to keep schedstat files open for. The rest are opened each time. */
+
+/* Heartbeat gap learning */
+#define  GAP_BUCKETS                112 /* Quarter octave buckets of milliseconds up to about 3 days */
+#define  GAP_MIN_SAMPLES            100 /* Don't trust the learned distribution until this many heartbeats */
+#define  GAP_MAX_SAMPLES            10000 /* Halve the counts here so that old gaps fade out */
+#define  GAP_WARNING_INTERVAL       600 /* Seconds between late heartbeat breadcrumbs */
+#define  DEFAULT_GAP_WARNING_PERCENT 50
+
+/* Reboot cause ledger */
+#define  LEDGER_SLOTS               16
+#define  LEDGER_MAGIC               0x314c4248 /* "HBL1" */
+
+/* Boot-to-ready times */
+#define  BOOT_TIMES_SLOTS           16
+#define  BOOT_TIMES_MAGIC           0x31544248 /* "HBT1" */
+#define  BOOT_TIME_UNSET            UINT32_MAX
+
+/* Seconds to wait for each ledger or boot time write before rebooting */
+#define  RING_FILE_WRITE_TIMEOUT    5
+
+/* Flight recorder */
+#define  FLIGHT_EVENTS              64 /* Power of 2 */
+
+/* Low power mode */
+#define  DEFAULT_LOW_POWER_TIMER_SLACK_MS 500
+#define  WAKEUP_WINDOW              3600 /* Report wakeups per hour */
+
+/* Guarded reboot escalation */
+#define  GUARDED_SYNC_TIMEOUT       5 /* Give up on sync during guarded reboots, poweroffs and halts */
+
+/* Hot re-exec */
+#define  REEXEC_MAGIC               0x31584548 /* "HEX1" */
+
+/* Room for two of the largest messages to Erlang */
+#define  OUTBOUND_QUEUE_SIZE        (2 * MSG_TOTAL_SIZE)
+
 static int wdt_pet_timeout = DEFAULT_WDT_PET_TIMEOUT;
 
 /* heart_beat_timeout is the maximum gap in seconds between two
@@ -205,6 +300,94 @@ static time_t snooze_end_time = 0;
 /* Set to one when either the SIGUSR1 is received */
 static int snooze_requested = 0;
 
+/* Percent of time that all tasks can be stalled on memory or IO before it
+   counts against health. 0=unused */
+static int psi_threshold = 0;
+
+/* Seconds that a stall needs to last before rebooting */
+static int psi_duration = DEFAULT_PSI_DURATION;
+
+/* When the current stall started and when its last trigger fired. 0=not stalled */
+static time_t psi_stall_start = 0;
+static time_t psi_last_event = 0;
+
+struct psi_resource {
+    const char *name;
+    const char *trigger_kind; /* NULL if this resource is only reported */
+    int fd;
+    int trigger;
+};
+
+/* CPU contention alone doesn't mean that the device is stuck, so only report it */
+static struct psi_resource psi_resources[] = {
+    { "cpu", NULL, -1, 0 },
+    { "memory", "full", -1, 0 },
+    { "io", "full", -1, 0 }
+};
+#define PSI_RESOURCE_COUNT (sizeof(psi_resources) / sizeof(psi_resources[0]))
+
+/* Resource usage of the Erlang VM from /proc/<pid> */
+struct vm_sample {
+    time_t time;
+    unsigned long long cpu_ticks;    /* utime + stime */
+    unsigned long long run_delay_ns; /* Time all threads spent waiting on a run queue */
+    unsigned long major_faults;
+    long rss_kb;
+    long swap_kb;
+    long threads;
+};
+
+/* Rates between two samples */
+struct vm_rates {
+    int cpu;             /* Percent of one CPU */
+    int run_delay;       /* Percent of the time that threads waited to run (summed over threads) */
+    long major_faults;   /* Per second */
+};
+
+static int vm_stat_fd = -1;
+static int vm_status_fd = -1;
+static int vm_task_fd = -1;
+static long vm_clock_ticks = 100;
+
+#ifdef __linux__
+/* Open schedstat files of the VM's threads */
+struct vm_thread {
+    int tid;
+    int fd;
+    unsigned int seen;   /* Last read_vm_run_delay() pass that found the thread */
+};
+
+static struct vm_thread vm_threads[VM_MAX_THREADS];
+static int vm_thread_count = 0;
+#endif
+
+/* The previous sample and the rates up to it */
+static struct vm_sample vm_last;
+static struct vm_rates vm_last_rates;
+
+/* Moving average of RSS growth in kB/hour */
+static long vm_rss_growth = 0;
+
+/* Histogram of the time between heartbeats. See gap_bucket(). */
+static uint32_t gap_histogram[GAP_BUCKETS];
+static uint32_t gap_samples = 0;
+
+/* Learned 99.9th percentile heartbeat gap in milliseconds */
+static int64_t gap_p999_ms = 0;
+
+/* Warn when a heartbeat is this late relative to the heartbeat timeout */
+static int gap_warning_percent = DEFAULT_GAP_WARNING_PERCENT;
+
+/* Monotonic time in milliseconds when the last heartbeat really arrived */
+static int64_t last_heart_beat_ms = 0;
+
+/* Set when the current gap is abnormally long */
+static int heartbeat_late = 0;
+static unsigned int heartbeat_late_count = 0;
+
+/* When the last late heartbeat breadcrumb was logged. 0=never */
+static time_t last_gap_warning_time = 0;
+
 /* reasons for reboot */
 #define  R_TIMEOUT          (1)
 #define  R_CLOSED           (2)
@@ -212,6 +395,149 @@ static int snooze_requested = 0;
 #define  R_SHUT_DOWN        (4)
 #define  R_CRASHING         (5) /* Doing a crash dump and we will wait for it */
 
+/* Termination causes recorded in the ledger. These are more specific than
+   the reasons above. Keep in sync with ledger_cause_names. */
+#define  CAUSE_NONE                       0
+#define  CAUSE_HEARTBEAT_TIMEOUT          1
+#define  CAUSE_INIT_HANDSHAKE_TIMEOUT     2
+#define  CAUSE_PSI_STALL                  3
+#define  CAUSE_DISABLE_VM                 4
+#define  CAUSE_DISABLE_HW                 5
+#define  CAUSE_CLOSED                     6
+#define  CAUSE_ERROR                      7
+#define  CAUSE_CRASHING                   8
+#define  CAUSE_SHUT_DOWN                  9
+#define  CAUSE_GUARDED_REBOOT             10
+#define  CAUSE_GUARDED_IMMEDIATE_REBOOT   11
+#define  CAUSE_GUARDED_POWEROFF           12
+#define  CAUSE_GUARDED_IMMEDIATE_POWEROFF 13
+#define  CAUSE_GUARDED_HALT               14
+
+static const char * const ledger_cause_names[] = {
+    "none",
+    "heartbeat_timeout",
+    "init_handshake_timeout",
+    "psi_stall",
+    "disable_vm",
+    "disable_hw",
+    "closed",
+    "error",
+    "crashing",
+    "shut_down",
+    "guarded_reboot",
+    "guarded_immediate_reboot",
+    "guarded_poweroff",
+    "guarded_immediate_poweroff",
+    "guarded_halt"
+};
+
+/* Set before message_loop returns when the reason alone isn't specific enough */
+static int termination_cause = CAUSE_NONE;
+
+/*
+ * A file of fixed size entries that's used like a ring buffer and kept in
+ * memory. Entry N goes in slot (N - 1) % slots. Each write only touches one
+ * slot and a CRC-32 at the end of each entry catches torn writes, so a crash
+ * mid-write only loses that entry. Entries start with struct ring_header.
+ */
+struct ring_header {
+    uint32_t magic;
+    uint32_t sequence;           /* 1 for the first entry ever */
+};
+
+struct ring_file {
+    const char *name;            /* For log messages */
+    uint32_t magic;
+    size_t entry_size;
+    uint32_t slots;
+    void *entries;
+    int (*valid)(const void *entry); /* Optional check beyond the CRC */
+    int fd;
+    uint32_t sequence;           /* Newest entry or 0 if none */
+    const void *pending;         /* Entry being written by the writer thread */
+    pthread_t writer;
+    int writing;                 /* 1 until the writer thread is joined */
+};
+
+/*
+ * One entry in the reboot cause ledger
+ */
+struct ledger_entry {
+    struct ring_header header;
+    int64_t wall_time;           /* CLOCK_REALTIME seconds */
+    uint32_t uptime;             /* CLOCK_MONOTONIC seconds */
+    uint32_t heartbeat_age;      /* Seconds since the last heartbeat */
+    int32_t wdt_pet_time_left;
+    int32_t init_handshake_time_left;
+    uint8_t cause;
+    uint8_t init_handshake_happened;
+    uint8_t snoozing;
+    uint8_t reserved[25];
+    uint32_t crc;                /* CRC-32 of everything above */
+};
+
+_Static_assert(sizeof(struct ledger_entry) == 64, "ledger entries should be 64 bytes");
+
+static int ledger_cause_valid(const void *entry)
+{
+    return ((const struct ledger_entry *) entry)->cause < sizeof(ledger_cause_names) / sizeof(ledger_cause_names[0]);
+}
+
+static struct ledger_entry ledger[LEDGER_SLOTS];
+static struct ring_file ledger_file = {
+    "reboot ledger", LEDGER_MAGIC, sizeof(struct ledger_entry), LEDGER_SLOTS, ledger, ledger_cause_valid, -1, 0, NULL, 0, 0
+};
+
+/*
+ * How long one start took to get ready. Times that weren't measured are
+ * BOOT_TIME_UNSET.
+ */
+struct boot_time_entry {
+    struct ring_header header;
+    int64_t wall_time;           /* CLOCK_REALTIME seconds when ready */
+    uint32_t first_heartbeat_ms; /* From heart starting to the first heartbeat */
+    uint32_t init_handshake_ms;  /* From heart starting to the init handshake */
+    uint32_t grace_used_percent; /* Time to ready as a percent of HEART_INIT_GRACE_TIME */
+    uint32_t crc;                /* CRC-32 of everything above */
+};
+
+_Static_assert(sizeof(struct boot_time_entry) == 32, "boot time entries should be 32 bytes");
+
+static struct boot_time_entry boot_times[BOOT_TIMES_SLOTS];
+static struct ring_file boot_times_file = {
+    "boot times", BOOT_TIMES_MAGIC, sizeof(struct boot_time_entry), BOOT_TIMES_SLOTS, boot_times, NULL, -1, 0, NULL, 0, 0
+};
+static int64_t start_ms = 0;
+static uint32_t first_heartbeat_ms = BOOT_TIME_UNSET;
+static uint32_t init_handshake_ms = BOOT_TIME_UNSET;
+
+/* Flight recorder event types. Keep in sync with flight_recorder_flush(). */
+#define  FLIGHT_HEARTBEAT           1 /* value is the gap in ms */
+#define  FLIGHT_LATE_HEARTBEAT      2 /* value is the gap in ms */
+#define  FLIGHT_PET                 3 /* value is the pet latency in us */
+#define  FLIGHT_WDT_ERROR           4 /* value is errno */
+#define  FLIGHT_SET_CMD             5 /* value is the ledger cause or CAUSE_NONE */
+#define  FLIGHT_INIT_HANDSHAKE      6
+#define  FLIGHT_SNOOZE              7
+#define  FLIGHT_SNOOZE_END          8
+#define  FLIGHT_GRACE_END           9
+
+struct flight_event {
+    int64_t time_ms;
+    int32_t value;
+    int32_t type;
+};
+
+/*
+ * Recent events for figuring out what happened before a reboot. The pet
+ * thread records too, so slots are claimed atomically.
+ */
+static struct flight_event flight_events[FLIGHT_EVENTS];
+static atomic_uint flight_next = 0;
+
+/* Set after flushing on a WDT that's about to expire. Cleared on the next pet. */
+static int flight_flushed = 0;
+
 /*  macros */
 
 #define  NULLFDS  ((fd_set *) NULL)
@@ -222,11 +548,14 @@ static int message_loop(void);
 static void do_terminate(int);
 static int notify_ack(void);
 static int heart_cmd_info_reply(time_t now);
-static int write_message(int, const struct msg *);
+static int write_message(const struct msg *);
+static void flush_outbound_queue();
+static void set_stdout_nonblocking();
 static int read_message(int, struct msg *);
 static int read_skip(int, char *, int, int);
 static int read_fill(int, char *, int);
 static time_t timestamp_seconds();
+static int64_t timestamp_ms();
 static int  wait_until_close_write_or_env_tmo(int);
 
 /*  static variables */
@@ -235,199 +564,1803 @@ static char * const watchdog_path_default = "/dev/watchdog0";
 static int watchdog_open_retries = 10;
 static int watchdog_fd = -1;
 
+/*
+ * Protects the watchdog fd, pet timeout and last pet time when the pet thread
+ * is running. It uses priority inheritance since the pet thread can be
+ * real-time. See init_watchdog_lock().
+ */
+static pthread_mutex_t watchdog_lock;
+
+/* Set to 1 when a dedicated thread does the timer-driven WDT pets */
+static int pet_thread_running = 0;
+
+/* The pet thread pets the WDT up until this time. The main loop moves it out. */
+static atomic_llong pet_thread_healthy_until = 0;
+
+/*
+ * Adaptive pet interval. The pet interval is the WDT timeout minus the worst
+ * pet lateness and countdown drift that's been seen. Protected by
+ * watchdog_lock.
+ */
+static int adaptive_pet = 0;
+static int pet_hysteresis = DEFAULT_PET_HYSTERESIS;
+static int wdt_timeleft_supported = 1;
+static int64_t last_wdt_pet_ms = 0;
+static int32_t pet_lateness_ms = 0; /* Decaying max of how late and how long pets took */
+static int32_t wdt_drift_ppm = 0;   /* Decaying max of how much faster the WDT counts than nominal */
+static int wdt_drift_warned = 0;
+
+/* Set to 1 to trade diagnostics for fewer CPU wakeups */
+static int low_power = 0;
+
+/* Wakeups by the main loop and pet thread for calculating wakeups per hour */
+static atomic_uint wakeups = 0;
+static time_t wakeup_window_start = 0;
+static unsigned int last_window_wakeups = 0;
+static int wakeup_window_done = 0;
+
+/* Set to 1 when recoveries should kexec into the loaded kernel instead of restarting */
+static int kexec_ready = 0;
+
+/* Seconds to wait for PID 1 to finish a guarded reboot, poweroff or halt. 0 to wait for the WDT. */
+static int guarded_timeout = 0;
+
+/* When set, do the guarded reboot, poweroff or halt directly at this time */
+static int64_t guarded_deadline_ms = 0;
+static int64_t guarded_start_ms = 0;
+static int guarded_reboot_cmd = 0;
+static const char *guarded_what = NULL;
+
+/* Set by SIGUSR2 to re-exec heart */
+static volatile sig_atomic_t reexec_requested = 0;
+
+/* Hot re-exec stats. The handoff time is from deciding to re-exec until the new image is running the loop. */
+static unsigned int reexec_count = 0;
+static int64_t reexec_handoff_ms = 0;
+
+/* heart's arguments for re-exec'ing */
+static char **heart_argv = NULL;
+
+/* Messages waiting for Erlang to read them */
+static char outbound_queue[OUTBOUND_QUEUE_SIZE];
+static size_t outbound_queue_len = 0;
+static unsigned int outbound_queue_drops = 0;
+
+static inline void flight_record(int type, int64_t time_ms, int32_t value)
+{
+    struct flight_event *event =
+        &flight_events[atomic_fetch_add_explicit(&flight_next, 1, memory_order_relaxed) % FLIGHT_EVENTS];
+    event->time_ms = time_ms;
+    event->value = value;
+    event->type = type;
+}
+
 static int is_env_set(char *key)
 {
     return getenv(key) != NULL;
 }
 
-static char *get_env(char *key)
+static char *get_env(char *key)
+{
+    return getenv(key);
+}
+
+
+static void set_default_logging_verbosity()
+{
+    // If logging to kmsg, then log more since kmsg supports log levels.
+    if (access("/dev/kmsg", W_OK) == 0)
+        elog_level = ELOG_LEVEL_INFO;
+    else
+        elog_level = ELOG_LEVEL_ERROR;
+ }
+
+static void set_logging_verbosity()
+{
+    const char *verbose_value = get_env(HEART_VERBOSE);
+    if (!verbose_value) {
+        set_default_logging_verbosity();
+        return;
+    }
+
+    // Per Erlang heart documentation:
+    // 0 = no prints, 1 = important prints, 2 = informational prints
+    switch (atoi(verbose_value)) {
+    case 0:
+        elog_level = ELOG_LEVEL_EMERG;
+        break;
+    case 1:
+        set_default_logging_verbosity();
+        break;
+    default:
+        elog_level = ELOG_LEVEL_DEBUG;
+        break;
+    }
+}
+
+static void set_pmsg_format()
+{
+    const char *format = get_env(HEART_PMSG_FORMAT);
+    if (format && strcmp(format, "binary") == 0)
+        elog_pmsg_format = ELOG_PMSG_BINARY;
+}
+
+/*
+ * Only the main thread opens the WDT. The open, ioctls and logging happen
+ * without watchdog_lock so that the pet thread never waits on them. The lock
+ * is only taken to publish the fd and timeouts.
+ */
+static int watchdog_needs_open()
+{
+    pthread_mutex_lock(&watchdog_lock);
+    int need_open = watchdog_fd < 0 && watchdog_open_retries > 0;
+    pthread_mutex_unlock(&watchdog_lock);
+    return need_open;
+}
+
+static void try_open_watchdog()
+{
+    /* The watchdog device sometimes takes a bit to appear, so give it a few tries. */
+    if (!watchdog_needs_open())
+       return;
+
+    char *watchdog_path = get_env(HEART_WATCHDOG_PATH);
+    if (watchdog_path == NULL)
+        watchdog_path = watchdog_path_default;
+
+    int fd = open(watchdog_path, O_WRONLY);
+    if (fd >= 0) {
+        int new_wdt_timeout = wdt_timeout;
+        int new_wdt_pet_timeout = wdt_pet_timeout;
+        int real_wdt_timeout;
+        int set_wdt_timeout = 0;
+        int ret = 0;
+        char *kernel_timeout_env = get_env(HEART_KERNEL_TIMEOUT_ENV);
+
+        if (kernel_timeout_env != NULL) {
+            struct watchdog_info info;
+            if (ioctl(fd, WDIOC_GETSUPPORT, &info) == 0 &&
+                info.options & WDIOF_SETTIMEOUT) {
+
+                set_wdt_timeout = atoi(kernel_timeout_env);
+                if (set_wdt_timeout >= MIN_WDT_PET_TIMEOUT &&
+                    set_wdt_timeout <= MAX_WDT_PET_TIMEOUT) {
+                    ret = ioctl(fd, WDIOC_SETTIMEOUT, &set_wdt_timeout);
+                    if (ret == 0) {
+                        elog(ELOG_INFO, "kernel WDT timeout set to %ds", set_wdt_timeout);
+                    } else {
+                        elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ds (ioctl ret %d, errno %d: %s)",
+                                  set_wdt_timeout, ret, errno, strerror(errno));
+                    }
+                } else {
+                    elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ds (invalid range %d-%d)",
+                              set_wdt_timeout, MIN_WDT_PET_TIMEOUT, MAX_WDT_PET_TIMEOUT);
+                }
+            } else {
+                elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ss (not supported)", kernel_timeout_env);
+            }
+        }
+
+        ret = ioctl(fd, WDIOC_GETTIMEOUT, &real_wdt_timeout);
+        if (ret == 0 && real_wdt_timeout >= MIN_WDT_PET_TIMEOUT) {
+            new_wdt_timeout = real_wdt_timeout;
+            /* Most of the time, pet WDT_PET_TIMEOUT_BUFFER seconds before the timeout,
+             * but if it's really short, then pet half the timeout.
+             */
+            if (real_wdt_timeout > 2*WDT_PET_TIMEOUT_BUFFER)
+                new_wdt_pet_timeout = real_wdt_timeout - WDT_PET_TIMEOUT_BUFFER;
+            else
+                new_wdt_pet_timeout = real_wdt_timeout / 2;
+        } else if (ret != 0) {
+            elog(ELOG_ERROR, "error or too short WDT timeout so using defaults!");
+        }
+
+        elog(ELOG_INFO | ELOG_PMSG, "kernel watchdog activated. WDT timeout %ds, WDT pet interval %ds, VM timeout %ds, initial grace period %lds", new_wdt_timeout, new_wdt_pet_timeout, heart_beat_timeout, (long) init_grace_time);
+
+        pthread_mutex_lock(&watchdog_lock);
+        watchdog_fd = fd;
+        wdt_timeout = new_wdt_timeout;
+        wdt_pet_timeout = new_wdt_pet_timeout;
+        pthread_mutex_unlock(&watchdog_lock);
+    } else {
+        flight_record(FLIGHT_WDT_ERROR, timestamp_ms(), errno);
+        watchdog_open_retries--;
+        if (watchdog_open_retries <= 0) {
+            elog(ELOG_ERROR, "can't open '%s'. Running without kernel watchdog: %s", watchdog_path, strerror(errno));
+            pthread_mutex_lock(&watchdog_lock);
+            wdt_timeout = wdt_pet_timeout = 60*60*24*365;
+            pthread_mutex_unlock(&watchdog_lock);
+        }
+        return;
+    }
+}
+
+/*
+ * Measure how close this pet was to the WDT expiring and move the pet interval
+ * to keep a safe margin. Only pets late in the interval are used since early
+ * ones say little about lateness and the WDT's time left has 1 second
+ * resolution. Shrinking is immediate. Growing waits for the hysteresis so that
+ * the interval doesn't bounce around. Called with watchdog_lock held, so
+ * anything to log goes in the result for logging after it's released.
+ */
+struct pet_calibration {
+    int drift_warning_ppm; /* Non-zero to warn about WDT drift */
+    int old_interval;
+    int new_interval;      /* Differs from old_interval if it changed */
+};
+
+static void calibrate_pet_interval(int64_t pet_start_ms, int64_t latency_ms, int time_left, struct pet_calibration *result)
+{
+    int64_t elapsed_ms = pet_start_ms - last_wdt_pet_ms;
+    int64_t interval_ms = wdt_pet_timeout * 1000LL;
+    if (last_wdt_pet_ms == 0 || elapsed_ms < interval_ms / 2)
+        return;
+
+    int64_t lateness_ms = elapsed_ms > interval_ms ? elapsed_ms - interval_ms : 0;
+    int32_t sample_ms = lateness_ms + latency_ms;
+    pet_lateness_ms -= pet_lateness_ms / 8;
+    if (sample_ms > pet_lateness_ms)
+        pet_lateness_ms = sample_ms;
+
+    if (time_left >= 0) {
+        // Assume the most time left that the rounded down time_left allows
+        int64_t drift_ms = (wdt_timeout * 1000LL - elapsed_ms) - (time_left + 1) * 1000LL;
+        int32_t drift_ppm = drift_ms > 0 ? drift_ms * 1000000 / elapsed_ms : 0;
+        wdt_drift_ppm -= wdt_drift_ppm / 8;
+        if (drift_ppm > wdt_drift_ppm)
+            wdt_drift_ppm = drift_ppm;
+
+        if (drift_ppm > WDT_DRIFT_WARNING_PPM && !wdt_drift_warned) {
+            result->drift_warning_ppm = drift_ppm;
+            wdt_drift_warned = 1;
+        }
+    }
+
+    // The lateness only covers pets that were seen. Pets are scheduled in whole
+    // seconds, so any pet can be up to a second later than the interval says.
+    int64_t margin_ms = MIN_WDT_PET_MARGIN_MS + PET_TIMER_RESOLUTION_MS + pet_lateness_ms +
+                        wdt_timeout * (int64_t) wdt_drift_ppm / 1000;
+    int target = wdt_timeout - (int) ((margin_ms + 999) / 1000);
+    if (target < 1)
+        target = 1;
+
+    if (target < wdt_pet_timeout || target >= wdt_pet_timeout + pet_hysteresis)
+        wdt_pet_timeout = target;
+}
+
+/*
+ * Write to the WDT if it's open. This is all that the pet thread does. Only
+ * the fd, ioctl and write happen with watchdog_lock held.
+ */
+static void write_watchdog(time_t now)
+{
+    struct pet_calibration calibration = { 0, 0, 0 };
+    int pet_errno = 0;
+
+    HEART_PROBE1(pet_entry, now);
+    pthread_mutex_lock(&watchdog_lock);
+    if (watchdog_fd >= 0) {
+        // Check the WDT's countdown before the pet resets it
+        int time_left = -1;
+        if (adaptive_pet && wdt_timeleft_supported && ioctl(watchdog_fd, WDIOC_GETTIMELEFT, &time_left) < 0) {
+            wdt_timeleft_supported = 0;
+            time_left = -1;
+        }
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int rc = write(watchdog_fd, "\0", 1);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        HEART_PROBE2(pet_result, rc, rc < 0 ? errno : 0);
+
+        int64_t pet_start_ms = (int64_t) start.tv_sec * 1000 + start.tv_nsec / 1000000;
+        if (rc >= 0) {
+            int64_t latency_us = (end.tv_sec - start.tv_sec) * 1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+            if (adaptive_pet) {
+                calibration.old_interval = wdt_pet_timeout;
+                calibrate_pet_interval(pet_start_ms, (latency_us + 999) / 1000, time_left, &calibration);
+                calibration.new_interval = wdt_pet_timeout;
+            }
+
+            last_wdt_pet_time = now;
+            last_wdt_pet_ms = pet_start_ms;
+            flight_flushed = 0;
+            flight_record(FLIGHT_PET, pet_start_ms, latency_us);
+        } else {
+            pet_errno = errno;
+            flight_record(FLIGHT_WDT_ERROR, pet_start_ms, pet_errno);
+
+            // Retry next time if there is a next time.
+            close(watchdog_fd);
+            watchdog_fd = -1;
+        }
+    }
+    int32_t lateness_ms = pet_lateness_ms;
+    int32_t drift_ppm = wdt_drift_ppm;
+    int timeout = wdt_timeout;
+    pthread_mutex_unlock(&watchdog_lock);
+
+    if (pet_errno)
+        elog(ELOG_ERROR, "error petting watchdog: %s", strerror(pet_errno));
+    if (calibration.drift_warning_ppm)
+        elog(ELOG_WARNING | ELOG_PMSG, "WDT counts down %d.%d%% faster than its %ds timeout",
+             calibration.drift_warning_ppm / 10000, (calibration.drift_warning_ppm / 1000) % 10, timeout);
+    if (calibration.new_interval != calibration.old_interval)
+        elog(ELOG_INFO, "WDT pet interval %ds -> %ds (lateness %d ms, drift %d ppm)",
+             calibration.old_interval, calibration.new_interval, lateness_ms, drift_ppm);
+}
+
+static void pet_watchdog(time_t now)
+{
+    try_open_watchdog();
+    write_watchdog(now);
+}
+
+/*
+ * The pet thread does the timer-driven WDT pets so that they happen on time
+ * even if the main thread is blocked on a slow ioctl or log write. It only
+ * pets while the main loop says that things are healthy. All decisions on
+ * whether to reboot stay with the main loop.
+ */
+static void *pet_thread_main(void *arg)
+{
+    (void) arg;
+
+    while (1) {
+        time_t now = timestamp_seconds();
+
+        pthread_mutex_lock(&watchdog_lock);
+        time_t next_pet_time = last_wdt_pet_time + wdt_pet_timeout;
+        pthread_mutex_unlock(&watchdog_lock);
+
+        if (now >= next_pet_time && now < atomic_load(&pet_thread_healthy_until)) {
+            write_watchdog(now);
+
+            pthread_mutex_lock(&watchdog_lock);
+            next_pet_time = last_wdt_pet_time + wdt_pet_timeout;
+            pthread_mutex_unlock(&watchdog_lock);
+        }
+
+        struct timespec ts;
+        ts.tv_sec = next_pet_time > now ? next_pet_time - now : 1;
+        ts.tv_nsec = 0;
+        nanosleep(&ts, NULL);
+        atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static void start_pet_thread()
+{
+    const char *priority_env = get_env(HEART_PET_THREAD_PRIORITY);
+    if (!priority_env)
+        return;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PET_THREAD_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int rc = pthread_create(&thread, &attr, pet_thread_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        elog(ELOG_ERROR, "can't start pet thread, so petting from main loop: %s", strerror(rc));
+        return;
+    }
+    pet_thread_running = 1;
+
+    struct sched_param param;
+    param.sched_priority = atoi(priority_env);
+    rc = pthread_setschedparam(thread, SCHED_FIFO, &param);
+    if (rc != 0)
+        elog(ELOG_ERROR, "can't set pet thread to SCHED_FIFO priority %d: %s", param.sched_priority, strerror(rc));
+
+#ifdef __linux__
+    const char *cpu_env = get_env(HEART_PET_THREAD_CPU);
+    if (cpu_env) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(atoi(cpu_env), &cpus);
+        rc = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+        if (rc != 0)
+            elog(ELOG_ERROR, "can't pin pet thread to CPU %s: %s", cpu_env, strerror(rc));
+    }
+#endif
+
+    elog(ELOG_INFO, "pet thread started with SCHED_FIFO priority %d", param.sched_priority);
+}
+
+static void update_pet_thread_healthy_until()
+{
+    time_t healthy_until = last_heart_beat_time + heart_beat_timeout;
+    if (!init_handshake_happened && init_handshake_end_time < healthy_until)
+        healthy_until = init_handshake_end_time;
+
+    atomic_store(&pet_thread_healthy_until, healthy_until);
+}
+
+/*
+ *  main
+ */
+static void get_arguments(int argc, char **argv)
+{
+    int i = 1;
+    int h = -1;
+    unsigned long p = 0;
+
+    while (i < argc) {
+        switch (argv[i][0]) {
+        case '-':
+            switch (argv[i][1]) {
+            case 'h':
+                if (strcmp(argv[i], "-ht") == 0)
+                    if (sscanf(argv[i + 1], "%i", &h) == 1)
+                        if ((h > 10) && (h <= 65535)) {
+                            heart_beat_timeout = h;
+                            i++;
+                        }
+                break;
+            case 'p':
+                if (strcmp(argv[i], "-pid") == 0)
+                    if (sscanf(argv[i + 1], "%lu", &p) == 1) {
+                        heart_beat_kill_pid = p;
+                        i++;
+                    }
+                break;
+            default:
+                ;
+            }
+            break;
+        default:
+            ;
+        }
+        i++;
+    }
+}
+
+static void stop_petting_watchdog()
+{
+    // Stop petting of the hardware watchdog by forgetting the
+    // file handle and marking that there are no retries left to
+    // open it. Do not close the file handle since that might
+    // tell Linux to disable the watchdog if the kernel doesn't
+    // have CONFIG_WDT_NOWAYOUT=y.
+    pthread_mutex_lock(&watchdog_lock);
+    watchdog_open_retries = 0;
+    watchdog_fd = -1;
+
+    // Set the pet timeout out really long so that if control
+    // ends up in the select loop, the WDT pet timeout won't
+    // exit select early.
+    wdt_pet_timeout = 86400;
+    pthread_mutex_unlock(&watchdog_lock);
+}
+
+static void set_oom_score_adj(int adj)
+{
+    char str[16];
+    int len = snprintf(str, sizeof(str), "%d", adj);
+
+    int fd = open("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || write(fd, str, len) != len)
+        elog(ELOG_ERROR, "can't set oom_score_adj to %d: %s", adj, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
+
+static void prefault_stack()
+{
+    volatile char stack[STACK_PREFAULT_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof(stack); i += 256)
+        stack[i] = 0;
+}
+
+/*
+ * Hardened mode keeps heart working when the system runs out of memory.
+ * All buffers are either static or on the stack, so locking all pages
+ * into memory and faulting in the stack now means that heart never
+ * waits on a page fault or allocates afterwards.
+ */
+static void harden()
+{
+    const char *envvar = get_env(HEART_HARDENED);
+    if (!envvar || strcmp(envvar, "TRUE") != 0)
+        return;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        elog(ELOG_ERROR, "mlockall failed: %s", strerror(errno));
+
+    prefault_stack();
+
+    int adj = DEFAULT_OOM_SCORE_ADJ;
+    envvar = get_env(HEART_OOM_SCORE_ADJ);
+    if (envvar)
+        adj = atoi(envvar);
+    set_oom_score_adj(adj);
+
+    elog(ELOG_INFO, "hardened: memory locked, oom_score_adj=%d", adj);
+}
+
+/*
+ * Open /proc/pressure files once so that reporting status doesn't need to
+ * open them again. If a threshold is set, register PSI triggers on them. The
+ * kernel only wakes heart up when the stall goes over the threshold, so
+ * there's no polling.
+ */
+static void init_psi()
+{
+    const char *envvar = get_env(HEART_PSI_THRESHOLD);
+    if (envvar) {
+        psi_threshold = atoi(envvar);
+        if (psi_threshold < 1 || psi_threshold > 100) {
+            elog(ELOG_ERROR, "ignoring invalid " HEART_PSI_THRESHOLD " '%s'", envvar);
+            psi_threshold = 0;
+        }
+    }
+    envvar = get_env(HEART_PSI_DURATION);
+    if (envvar) {
+        psi_duration = atoi(envvar);
+        if (psi_duration < 1)
+            psi_duration = 1;
+        else if (psi_duration > MAX_PSI_DURATION)
+            psi_duration = MAX_PSI_DURATION;
+    }
+
+    size_t i;
+    for (i = 0; i < PSI_RESOURCE_COUNT; i++) {
+        struct psi_resource *r = &psi_resources[i];
+        char path[32];
+        snprintf(path, sizeof(path), "/proc/pressure/%s", r->name);
+
+        if (psi_threshold > 0 && r->trigger_kind) {
+            r->fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (r->fd >= 0) {
+                char trigger[48];
+                int len = snprintf(trigger, sizeof(trigger), "%s %d %d", r->trigger_kind,
+                                   psi_threshold * (PSI_WINDOW_US / 100), PSI_WINDOW_US);
+                if (write(r->fd, trigger, len + 1) == len + 1)
+                    r->trigger = 1;
+                else
+                    elog(ELOG_ERROR, "can't set %s PSI trigger: %s", r->name, strerror(errno));
+            }
+        }
+        if (r->fd < 0)
+            r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    if (psi_threshold > 0)
+        elog(ELOG_INFO, "rebooting on memory or IO stalls above %d%% for %ds", psi_threshold, psi_duration);
+}
+
+/*
+ * Handle PSI triggers that fired. Returns 1 if a stall has lasted too long.
+ */
+static int psi_stalled_too_long(fd_set *fds, time_t now)
+{
+    size_t i;
+    for (i = 0; i < PSI_RESOURCE_COUNT; i++) {
+        struct psi_resource *r = &psi_resources[i];
+        if (!r->trigger || !FD_ISSET(r->fd, fds))
+            continue;
+
+        if (psi_stall_start == 0 || now - psi_last_event > PSI_STALL_GAP) {
+            psi_stall_start = now;
+            elog(ELOG_WARNING | ELOG_PMSG, "%s pressure stall above %d%%", r->name, psi_threshold);
+        }
+        psi_last_event = now;
+
+        if (now - psi_stall_start >= psi_duration && now >= snooze_end_time && now >= init_grace_end_time) {
+            elog(ELOG_ERROR | ELOG_PMSG, "%s pressure stall above %d%% for %lu seconds -> rebooting",
+                 r->name, psi_threshold, (unsigned long) (now - psi_stall_start));
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef __linux__
+static int read_schedstat(int fd, unsigned long long *run_delay)
+{
+    char schedstat[64];
+    ssize_t n = pread(fd, schedstat, sizeof(schedstat) - 1, 0);
+    if (n <= 0)
+        return -1;
+
+    schedstat[n] = '\0';
+    return sscanf(schedstat, "%*u %llu", run_delay) == 1 ? 0 : -1;
+}
+
+static int open_schedstat(int tid)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%d/schedstat", tid);
+    return openat(vm_task_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+/*
+ * Return the thread's open schedstat file. Threads that weren't seen before
+ * get theirs opened, so the files are only opened once per thread.
+ */
+static struct vm_thread *find_vm_thread(int tid)
+{
+    int i;
+    for (i = 0; i < vm_thread_count; i++) {
+        if (vm_threads[i].tid == tid)
+            return &vm_threads[i];
+    }
+
+    if (vm_thread_count == VM_MAX_THREADS)
+        return NULL;
+
+    int fd = open_schedstat(tid);
+    if (fd < 0)
+        return NULL;
+
+    struct vm_thread *thread = &vm_threads[vm_thread_count++];
+    thread->tid = tid;
+    thread->fd = fd;
+    return thread;
+}
+#endif
+
+/*
+ * Add up the run queue delay of all of the VM's threads. Per-thread
+ * schedstat files are the only place that Linux reports this. The task
+ * directory is read with getdents64 so that this doesn't allocate. The
+ * schedstat files stay open, so only new threads cost an open and threads
+ * that are gone get their files closed.
+ */
+static unsigned long long read_vm_run_delay()
+{
+    unsigned long long total = 0;
+#ifdef __linux__
+    static unsigned int pass = 0;
+    char buffer[1024] __attribute__((aligned(8)));
+    long len;
+    int i;
+
+    if (vm_task_fd < 0 || lseek(vm_task_fd, 0, SEEK_SET) < 0)
+        return 0;
+
+    pass++;
+    while ((len = syscall(SYS_getdents64, vm_task_fd, buffer, sizeof(buffer))) > 0) {
+        long offset = 0;
+        while (offset < len) {
+            struct dirent64 *entry = (struct dirent64 *) (buffer + offset);
+            offset += entry->d_reclen;
+
+            if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+                continue;
+
+            int tid = atoi(entry->d_name);
+            unsigned long long run_delay;
+            struct vm_thread *thread = find_vm_thread(tid);
+            if (thread) {
+                thread->seen = pass;
+                if (read_schedstat(thread->fd, &run_delay) == 0)
+                    total += run_delay;
+            } else {
+                // Too many threads to keep open
+                int fd = open_schedstat(tid);
+                if (fd < 0)
+                    continue;
+                if (read_schedstat(fd, &run_delay) == 0)
+                    total += run_delay;
+                close(fd);
+            }
+        }
+    }
+
+    for (i = 0; i < vm_thread_count;) {
+        if (vm_threads[i].seen != pass) {
+            close(vm_threads[i].fd);
+            vm_threads[i] = vm_threads[--vm_thread_count];
+        } else {
+            i++;
+        }
+    }
+#endif
+    return total;
+}
+
+static int read_vm_sample(struct vm_sample *sample, time_t now)
+{
+    char buffer[2048];
+    ssize_t len;
+
+    len = pread(vm_stat_fd, buffer, sizeof(buffer) - 1, 0);
+    if (len <= 0)
+        return -1;
+    buffer[len] = '\0';
+
+    /* Skip over the command name since it can have spaces and parentheses */
+    char *fields = strrchr(buffer, ')');
+    unsigned long utime;
+    unsigned long stime;
+    if (!fields ||
+        sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %lu %*u %lu %lu %*d %*d %*d %*d %ld",
+               &sample->major_faults, &utime, &stime, &sample->threads) != 4)
+        return -1;
+
+    sample->time = now;
+    sample->cpu_ticks = (unsigned long long) utime + stime;
+    sample->rss_kb = 0;
+    sample->swap_kb = 0;
+
+    len = pread(vm_status_fd, buffer, sizeof(buffer) - 1, 0);
+    if (len > 0) {
+        buffer[len] = '\0';
+
+        char *line = strstr(buffer, "VmRSS:");
+        if (line)
+            sscanf(line, "VmRSS: %ld", &sample->rss_kb);
+        line = strstr(buffer, "VmSwap:");
+        if (line)
+            sscanf(line, "VmSwap: %ld", &sample->swap_kb);
+    }
+
+    sample->run_delay_ns = read_vm_run_delay();
+    return 0;
+}
+
+static void calc_vm_rates(const struct vm_sample *from, const struct vm_sample *to, struct vm_rates *rates)
+{
+    long dt = to->time - from->time;
+
+    /* Counters go down when threads exit, so don't report negative rates */
+    rates->cpu = to->cpu_ticks > from->cpu_ticks ?
+        (int) ((to->cpu_ticks - from->cpu_ticks) * 100 / (vm_clock_ticks * dt)) : 0;
+    rates->run_delay = to->run_delay_ns > from->run_delay_ns ?
+        (int) ((to->run_delay_ns - from->run_delay_ns) / (10000000ULL * dt)) : 0;
+    rates->major_faults = to->major_faults > from->major_faults ?
+        (long) ((to->major_faults - from->major_faults) / dt) : 0;
+}
+
+/*
+ * The VM's pid comes from the -pid argument. Keep its /proc files open so
+ * that sampling is only a few preads.
+ */
+static void init_vm_monitor()
+{
+    char path[48];
+
+    if (heart_beat_kill_pid == 0)
+        return;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) heart_beat_kill_pid);
+    vm_stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) heart_beat_kill_pid);
+    vm_status_fd = open(path, O_RDONLY | O_CLOEXEC);
+    snprintf(path, sizeof(path), "/proc/%d/task", (int) heart_beat_kill_pid);
+    vm_task_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    vm_clock_ticks = sysconf(_SC_CLK_TCK);
+    if (vm_clock_ticks <= 0)
+        vm_clock_ticks = 100;
+
+    if (vm_stat_fd < 0 || read_vm_sample(&vm_last, timestamp_seconds()) < 0) {
+        elog(ELOG_ERROR, "can't monitor Erlang VM pid %d: %s", (int) heart_beat_kill_pid, strerror(errno));
+        if (vm_stat_fd >= 0)
+            close(vm_stat_fd);
+        vm_stat_fd = -1;
+    }
+}
+
+/*
+ * Called on heartbeats. Samples at most every VM_SAMPLE_INTERVAL seconds.
+ */
+static void sample_vm(time_t now)
+{
+    struct vm_sample sample;
+
+    if (vm_stat_fd < 0 || now - vm_last.time < VM_SAMPLE_INTERVAL)
+        return;
+    if (read_vm_sample(&sample, now) < 0)
+        return;
+
+    long dt = now - vm_last.time;
+    long slope = (sample.rss_kb - vm_last.rss_kb) * 3600 / dt;
+    long weight = dt < VM_RSS_GROWTH_WINDOW ? dt : VM_RSS_GROWTH_WINDOW;
+    vm_rss_growth += (slope - vm_rss_growth) * weight / VM_RSS_GROWTH_WINDOW;
+
+    calc_vm_rates(&vm_last, &sample, &vm_last_rates);
+    vm_last = sample;
+}
+
+/*
+ * Get the VM's current resource usage. Rates are since the last sample so
+ * they cover the time since the last heartbeat when the VM hangs.
+ */
+static int current_vm_stats(time_t now, struct vm_sample *sample, struct vm_rates *rates)
+{
+    if (vm_stat_fd < 0 || read_vm_sample(sample, now) < 0)
+        return -1;
+
+    if (now > vm_last.time)
+        calc_vm_rates(&vm_last, sample, rates);
+    else
+        *rates = vm_last_rates;
+    return 0;
+}
+
+static void log_vm_stats()
+{
+    struct vm_sample sample;
+    struct vm_rates rates;
+
+    if (current_vm_stats(timestamp_seconds(), &sample, &rates) < 0)
+        return;
+
+    elog(ELOG_ERROR, "vm: cpu %d%%, rss %ldkB (%+ldkB/h), swap %ldkB, major faults %ld/s, threads %ld, run delay %d%%",
+         rates.cpu, sample.rss_kb, vm_rss_growth, sample.swap_kb, rates.major_faults, sample.threads, rates.run_delay);
+}
+
+/*
+ * Heartbeat gaps go into quarter octave buckets. Buckets 0-3 are 0-3 ms and
+ * then each power of two is split into four. This covers all heartbeat
+ * timeouts with about 20% resolution in a fixed amount of memory.
+ */
+static int gap_bucket(int64_t ms)
+{
+    if (ms < 4)
+        return ms < 0 ? 0 : (int) ms;
+
+    int b = 63 - __builtin_clzll((unsigned long long) ms);
+    int k = 4 * (b - 1) + (int) ((ms >> (b - 2)) & 3);
+    return k < GAP_BUCKETS ? k : GAP_BUCKETS - 1;
+}
+
+static int64_t gap_bucket_start(int k)
+{
+    if (k < 4)
+        return k;
+
+    return (int64_t) (4 + k % 4) << (k / 4 - 1);
+}
+
+static void record_heartbeat_gap(int64_t now_ms)
+{
+    int k;
+
+    flight_record(FLIGHT_HEARTBEAT, now_ms, now_ms - last_heart_beat_ms);
+    gap_histogram[gap_bucket(now_ms - last_heart_beat_ms)]++;
+    last_heart_beat_ms = now_ms;
+    heartbeat_late = 0;
+
+    if (++gap_samples >= GAP_MAX_SAMPLES) {
+        gap_samples = 0;
+        for (k = 0; k < GAP_BUCKETS; k++) {
+            gap_histogram[k] /= 2;
+            gap_samples += gap_histogram[k];
+        }
+    }
+
+    // Find the bucket with the 99.9th percentile and use its upper end. With
+    // fewer than 1000 samples, this is the longest gap seen.
+    uint32_t tail = gap_samples / 1000;
+    uint32_t count = 0;
+    for (k = GAP_BUCKETS - 1; k > 0; k--) {
+        count += gap_histogram[k];
+        if (count > tail)
+            break;
+    }
+    gap_p999_ms = gap_bucket_start(k + 1);
+}
+
+/* How long a heartbeat gap can be before warning */
+static int64_t gap_warning_ms()
+{
+    int64_t limit = (int64_t) heart_beat_timeout * 10 * gap_warning_percent;
+    if (gap_samples >= GAP_MIN_SAMPLES && gap_p999_ms < limit)
+        limit = gap_p999_ms;
+    return limit;
+}
+
+/*
+ * Warn when a heartbeat is much later than normal. This gives time to capture
+ * diagnostics before the heartbeat timeout reboots the device.
+ */
+static void check_heartbeat_gap(int64_t now_ms, time_t now)
+{
+    if (heartbeat_late || now < snooze_end_time || now < init_grace_end_time)
+        return;
+
+    int64_t gap = now_ms - last_heart_beat_ms;
+    int64_t limit = gap_warning_ms();
+    if (gap < limit)
+        return;
+
+    heartbeat_late = 1;
+    heartbeat_late_count++;
+    flight_record(FLIGHT_LATE_HEARTBEAT, now_ms, gap);
+    if (last_gap_warning_time == 0 || now - last_gap_warning_time >= GAP_WARNING_INTERVAL) {
+        last_gap_warning_time = now;
+        elog(ELOG_WARNING | ELOG_PMSG, "heartbeat late: none for %lld ms (warn at %lld ms, timeout at %d s)",
+             (long long) gap, (long long) limit, heart_beat_timeout);
+    }
+}
+
+static uint32_t crc32(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t crc = 0xffffffff;
+
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+/*
+ * Append to a buffer that ends at end like snprintf. Output that doesn't fit
+ * is truncated and the returned pointer stays on the terminating '\0'.
+ */
+static char *append(char *p, char *end, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+static char *append(char *p, char *end, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (p >= end)
+        return p;
+
+    va_start(ap, fmt);
+    len = vsnprintf(p, end - p, fmt, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return p;
+    return len < end - p ? p + len : end - 1;
+}
+
+/*
+ * Run fn on a thread so that storage that stopped responding can't hold up the
+ * main loop. If the thread can't be started, fn is run directly and -1 is
+ * returned.
+ */
+static int start_storage_thread(pthread_t *tid, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STORAGE_THREAD_STACK_SIZE);
+    int rc = pthread_create(tid, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        fn(arg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait up to timeout seconds for a storage thread to finish. It's left running
+ * in the background if it takes too long. Returns 0 if it finished.
+ */
+static int join_storage_thread(pthread_t tid, int timeout)
+{
+#ifdef __linux__
+    // pthread_timedjoin_np only supports CLOCK_REALTIME
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    if (pthread_timedjoin_np(tid, NULL, &deadline) != 0) {
+        pthread_detach(tid);
+        return -1;
+    }
+#else
+    // No timed join, so this is only bounded on Linux
+    (void) timeout;
+    pthread_join(tid, NULL);
+#endif
+    return 0;
+}
+
+static uint32_t ring_entry_crc(const struct ring_file *ring, const void *entry)
+{
+    return crc32(entry, ring->entry_size - sizeof(uint32_t));
+}
+
+static int ring_entry_valid(const struct ring_file *ring, const void *entry)
+{
+    uint32_t crc;
+    memcpy(&crc, (const char *) entry + ring->entry_size - sizeof(crc), sizeof(crc));
+
+    return ((const struct ring_header *) entry)->magic == ring->magic &&
+           crc == ring_entry_crc(ring, entry) &&
+           (!ring->valid || ring->valid(entry));
+}
+
+/*
+ * Load a ring file in one read. Bad entries from torn writes are ignored.
+ */
+static void ring_file_open(struct ring_file *ring, const char *path)
+{
+    size_t size = ring->entry_size * ring->slots;
+    uint32_t i;
+
+    ring->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (ring->fd < 0) {
+        elog(ELOG_ERROR, "can't open %s '%s': %s", ring->name, path, strerror(errno));
+        return;
+    }
+
+    ssize_t len = pread(ring->fd, ring->entries, size, 0);
+    if (len < 0)
+        len = 0;
+    memset((char *) ring->entries + len, 0, size - len);
+
+    for (i = 0; i < ring->slots; i++) {
+        void *entry = (char *) ring->entries + i * ring->entry_size;
+        const struct ring_header *header = entry;
+        if (!ring_entry_valid(ring, entry))
+            memset(entry, 0, ring->entry_size);
+        else if (header->sequence > ring->sequence)
+            ring->sequence = header->sequence;
+    }
+}
+
+/*
+ * Return a cleared entry with the header filled in for the caller to fill in
+ * and pass to ring_file_write()
+ */
+static void *ring_file_next(struct ring_file *ring)
+{
+    void *entry = (char *) ring->entries + (ring->sequence % ring->slots) * ring->entry_size;
+    struct ring_header *header = entry;
+
+    memset(entry, 0, ring->entry_size);
+    header->magic = ring->magic;
+    header->sequence = ++ring->sequence;
+    return entry;
+}
+
+static void *ring_file_writer(void *arg)
+{
+    struct ring_file *ring = arg;
+    const struct ring_header *header = ring->pending;
+
+    off_t offset = (off_t) ((header->sequence - 1) % ring->slots) * ring->entry_size;
+    if (pwrite(ring->fd, ring->pending, ring->entry_size, offset) != (ssize_t) ring->entry_size ||
+        fdatasync(ring->fd) < 0)
+        elog(ELOG_ERROR, "can't write %s: %s", ring->name, strerror(errno));
+    return NULL;
+}
+
+/*
+ * Write an entry from ring_file_next() on the ring's writer thread so that the
+ * main loop never waits on storage. Each ring file is written at most once per
+ * run, so there's never more than one write in flight.
+ */
+static void ring_file_write(struct ring_file *ring, void *entry)
+{
+    uint32_t crc = ring_entry_crc(ring, entry);
+    memcpy((char *) entry + ring->entry_size - sizeof(crc), &crc, sizeof(crc));
+
+    ring->pending = entry;
+    ring->writing = start_storage_thread(&ring->writer, ring_file_writer, ring) == 0;
+}
+
+/*
+ * Wait up to timeout seconds for the ring's write to reach storage. Returns 0
+ * if it did or if there wasn't one.
+ */
+static int ring_file_wait(struct ring_file *ring, int timeout)
+{
+    if (!ring->writing)
+        return 0;
+
+    ring->writing = 0;
+    return join_storage_thread(ring->writer, timeout);
+}
+
+/*
+ * Return the nth newest entry or NULL if there isn't one
+ */
+static const void *ring_file_entry(const struct ring_file *ring, uint32_t n)
+{
+    if (n >= ring->slots || n >= ring->sequence)
+        return NULL;
+
+    const void *entry = (const char *) ring->entries + ((ring->sequence - n - 1) % ring->slots) * ring->entry_size;
+    if (((const struct ring_header *) entry)->sequence != ring->sequence - n)
+        return NULL;
+    return entry;
+}
+
+static void init_ledger()
+{
+    const char *path = get_env(HEART_LEDGER_PATH);
+    if (path)
+        ring_file_open(&ledger_file, path);
+}
+
+/*
+ * Record why heart is giving up. Only the first cause is recorded since, for
+ * example, a guarded reboot will also close stdin when Erlang exits.
+ */
+static void ledger_record(int cause, time_t now)
+{
+    static int recorded = 0;
+
+    if (ledger_file.fd < 0 || recorded)
+        return;
+    recorded = 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct ledger_entry *entry = ring_file_next(&ledger_file);
+    entry->wall_time = ts.tv_sec;
+    entry->uptime = now;
+    entry->heartbeat_age = now - last_heart_beat_ms / 1000;
+    entry->wdt_pet_time_left = last_wdt_pet_time + wdt_pet_timeout - now;
+    entry->init_handshake_time_left = init_handshake_happened ? 0 : init_handshake_end_time - now;
+    entry->cause = cause;
+    entry->init_handshake_happened = init_handshake_happened;
+    entry->snoozing = now < snooze_end_time;
+    ring_file_write(&ledger_file, entry);
+}
+
+static void init_boot_times()
+{
+    const char *path = get_env(HEART_BOOT_TIMES_PATH);
+    if (path)
+        ring_file_open(&boot_times_file, path);
+}
+
+/*
+ * Note a startup milestone and record this start once it's ready. Ready means
+ * that the first heartbeat came and that the init handshake did too if one is
+ * required. Milestones are only kept in memory until then, so the start is
+ * written once and on the writer thread. Starts that never get ready aren't
+ * recorded, but the ledger says why they ended.
+ */
+static void boot_time_milestone(uint32_t *milestone, int64_t now_ms)
+{
+    if (*milestone != BOOT_TIME_UNSET)
+        return;
+    *milestone = now_ms - start_ms;
+
+    if (first_heartbeat_ms == BOOT_TIME_UNSET ||
+        (init_handshake_timeout > 0 && init_handshake_ms == BOOT_TIME_UNSET))
+        return;
+
+    if (boot_times_file.fd < 0)
+        return;
+
+    uint32_t ready_ms = init_handshake_timeout > 0 ? init_handshake_ms : first_heartbeat_ms;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    struct boot_time_entry *entry = ring_file_next(&boot_times_file);
+    entry->wall_time = ts.tv_sec;
+    entry->first_heartbeat_ms = first_heartbeat_ms;
+    entry->init_handshake_ms = init_handshake_ms;
+    entry->grace_used_percent = init_grace_time > 0 ? ready_ms / (init_grace_time * 10) : BOOT_TIME_UNSET;
+    ring_file_write(&boot_times_file, entry);
+}
+
+/*
+ * Give the ledger and boot time writes a chance to reach storage before
+ * rebooting or exiting. Only call this after the last pet.
+ */
+static void wait_for_ring_files()
+{
+    if (ring_file_wait(&ledger_file, RING_FILE_WRITE_TIMEOUT) < 0)
+        elog(ELOG_ERROR | ELOG_PMSG, "Reboot ledger write timed out");
+    if (ring_file_wait(&boot_times_file, RING_FILE_WRITE_TIMEOUT) < 0)
+        elog(ELOG_ERROR | ELOG_PMSG, "Boot times write timed out");
+}
+
+/*
+ * Append min,median,max of each boot time over the recorded starts. Lists are
+ * empty when nothing was measured.
+ */
+static char *boot_times_info(char *p, char *end)
+{
+    const struct boot_time_entry *entry;
+    uint32_t i;
+    int field;
+
+    if (boot_times_file.fd < 0)
+        return p;
+
+    p = append(p, end, "boot_count=%u\n", boot_times_file.sequence);
+    for (field = 0; field < 3; field++) {
+        static const char * const keys[] = { "boot_first_heartbeat_ms", "boot_init_handshake_ms", "boot_grace_used_percent" };
+        uint32_t values[BOOT_TIMES_SLOTS];
+        int count = 0;
+
+        for (i = 0; (entry = ring_file_entry(&boot_times_file, i)) != NULL; i++) {
+            uint32_t value;
+            switch (field) {
+            case 0: value = entry->first_heartbeat_ms; break;
+            case 1: value = entry->init_handshake_ms; break;
+            default: value = entry->grace_used_percent; break;
+            }
+            if (value == BOOT_TIME_UNSET)
+                continue;
+
+            // Insertion sort since there are only a few
+            int j = count++;
+            while (j > 0 && values[j - 1] > value) {
+                values[j] = values[j - 1];
+                j--;
+            }
+            values[j] = value;
+        }
+
+        p = append(p, end, "%s=", keys[field]);
+        if (count > 0) {
+            uint32_t median = count % 2 ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+            p = append(p, end, "%u,%u,%u", values[0], median, values[count - 1]);
+        }
+        p = append(p, end, "\n");
+    }
+    return p;
+}
+
+/*
+ * Append comma-separated lists of the ledger entries, newest first
+ */
+static char *ledger_info(char *p, char *end)
+{
+    const struct ledger_entry *entry;
+    uint32_t i;
+    int field;
+
+    if (ledger_file.fd < 0)
+        return p;
+
+    p = append(p, end, "reboot_count=%u\n", ledger_file.sequence);
+    for (field = 0; field < 4; field++) {
+        static const char * const keys[] = { "reboot_causes", "reboot_times", "reboot_uptimes", "reboot_heartbeat_ages" };
+        p = append(p, end, "%s=", keys[field]);
+        for (i = 0; (entry = ring_file_entry(&ledger_file, i)) != NULL; i++) {
+            if (i > 0)
+                p = append(p, end, ",");
+            switch (field) {
+            case 0: p = append(p, end, "%s", ledger_cause_names[entry->cause]); break;
+            case 1: p = append(p, end, "%lld", (long long) entry->wall_time); break;
+            case 2: p = append(p, end, "%u", entry->uptime); break;
+            default: p = append(p, end, "%u", entry->heartbeat_age); break;
+            }
+        }
+        p = append(p, end, "\n");
+    }
+    return p;
+}
+
+/*
+ * Write the flight recorder to pmsg in one write so that the events stay
+ * together. Times are relative to now so that they don't depend on the
+ * monotonic clock.
+ */
+static void flight_recorder_flush(int64_t now_ms)
+{
+    static char buffer[FLIGHT_EVENTS * 64];
+    char *p = buffer;
+    char *end = buffer + sizeof(buffer);
+    unsigned int next = atomic_load(&flight_next);
+    unsigned int i = next > FLIGHT_EVENTS ? next - FLIGHT_EVENTS : 0;
+
+    for (; i != next; i++) {
+        const struct flight_event *event = &flight_events[i % FLIGHT_EVENTS];
+        p = append(p, end, "  %lld ms ", (long long) (event->time_ms - now_ms));
+        switch (event->type) {
+        case FLIGHT_HEARTBEAT: p = append(p, end, "heartbeat gap=%dms\n", event->value); break;
+        case FLIGHT_LATE_HEARTBEAT: p = append(p, end, "late heartbeat gap=%dms\n", event->value); break;
+        case FLIGHT_PET: p = append(p, end, "pet latency=%dus\n", event->value); break;
+        case FLIGHT_WDT_ERROR: p = append(p, end, "wdt error=%d\n", event->value); break;
+        case FLIGHT_SET_CMD: p = append(p, end, "set_cmd %s\n", ledger_cause_names[event->value]); break;
+        case FLIGHT_INIT_HANDSHAKE: p = append(p, end, "init_handshake\n"); break;
+        case FLIGHT_SNOOZE: p = append(p, end, "snooze\n"); break;
+        case FLIGHT_SNOOZE_END: p = append(p, end, "snooze end\n"); break;
+        case FLIGHT_GRACE_END: p = append(p, end, "grace period end\n"); break;
+        default: p = append(p, end, "unknown %d\n", event->type); break;
+        }
+    }
+
+    elog_pmsg_dump("flight recorder (newest last):", buffer, p - buffer);
+}
+
+/*
+ * When to flush the flight recorder if the WDT doesn't get pet. This is
+ * halfway between when it should have been pet and when it expires. Returns 0
+ * if it's already been flushed. Call with watchdog_lock held.
+ */
+static time_t flight_flush_time()
+{
+    if (flight_flushed)
+        return 0;
+
+    int margin = wdt_timeout > 2 * WDT_PET_TIMEOUT_BUFFER ? WDT_PET_TIMEOUT_BUFFER / 2 : wdt_timeout / 4;
+    return last_wdt_pet_time + wdt_timeout - margin;
+}
+
+static void check_flight_recorder(int64_t now_ms, time_t now)
+{
+    pthread_mutex_lock(&watchdog_lock);
+    time_t flush_time = flight_flush_time();
+    int flush = flush_time && now >= flush_time;
+    if (flush)
+        flight_flushed = 1;
+    pthread_mutex_unlock(&watchdog_lock);
+
+    if (flush)
+        flight_recorder_flush(now_ms);
+}
+
+/*
+ * Pet the WDT because of activity from Erlang. In low power mode, this only
+ * happens in the second half of the pet interval. The timer-driven pet would
+ * be soon anyway, so folding it in saves a wakeup without petting on every
+ * message.
+ */
+static void pet_watchdog_on_activity(time_t now)
+{
+    if (!low_power || now >= last_wdt_pet_time + wdt_pet_timeout / 2)
+        pet_watchdog(now);
+}
+
+static void count_wakeup(time_t now)
+{
+    atomic_fetch_add_explicit(&wakeups, 1, memory_order_relaxed);
+
+    if (now >= wakeup_window_start + WAKEUP_WINDOW) {
+        last_window_wakeups = atomic_exchange(&wakeups, 0);
+        wakeup_window_start = now;
+        wakeup_window_done = 1;
+    }
+}
+
+/*
+ * Wakeups in the last hour. Until there's been an hour, this is the number so
+ * far.
+ */
+static unsigned int wakeups_per_hour()
+{
+    return wakeup_window_done ? last_window_wakeups : atomic_load(&wakeups);
+}
+
+static void init_adaptive_pet()
+{
+    const char *env = get_env(HEART_ADAPTIVE_PET);
+    adaptive_pet = env && strcmp(env, "TRUE") == 0;
+
+    env = get_env(HEART_PET_HYSTERESIS);
+    if (env) {
+        pet_hysteresis = atoi(env);
+        if (pet_hysteresis < 1)
+            pet_hysteresis = 1;
+    }
+}
+
+static void init_low_power()
+{
+    const char *env = get_env(HEART_LOW_POWER);
+    low_power = env && strcmp(env, "TRUE") == 0;
+
+    int slack_ms = low_power ? DEFAULT_LOW_POWER_TIMER_SLACK_MS : 0;
+    const char *slack_env = get_env(HEART_TIMER_SLACK_MS);
+    if (slack_env)
+        slack_ms = atoi(slack_env);
+
+#ifdef __linux__
+    // Threads inherit the slack, but it doesn't apply to the SCHED_FIFO pet thread
+    if (slack_ms > 0 && prctl(PR_SET_TIMERSLACK, (unsigned long) slack_ms * 1000000UL, 0, 0, 0) < 0)
+        elog(ELOG_ERROR, "can't set timer slack to %d ms: %s", slack_ms, strerror(errno));
+#else
+    // Timer slack is Linux-only
+    (void) slack_ms;
+#endif
+}
+
+/*
+ * Check whether a kexec kernel is loaded. This is done at startup so that the
+ * result is in the breadcrumbs and there's less to do when rebooting.
+ */
+static void init_kexec()
+{
+    const char *env = get_env(HEART_KEXEC);
+    if (!env || strcmp(env, "TRUE") != 0)
+        return;
+
+    char loaded = '0';
+    int fd = open("/sys/kernel/kexec_loaded", O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &loaded, 1) != 1)
+            loaded = '0';
+        close(fd);
+    }
+
+    kexec_ready = (loaded == '1');
+    if (kexec_ready)
+        elog(ELOG_INFO | ELOG_PMSG, "kexec kernel loaded. Recoveries will use kexec.");
+    else
+        elog(ELOG_ERROR, "HEART_KEXEC is set, but no kexec kernel is loaded");
+}
+
+/*
+ * Reboot after giving up. Skipping the firmware and bootloader with kexec gets
+ * the application back sooner, but that's only done for heartbeat timeouts and
+ * crashes. Other causes like disable_vm, a missed init handshake or a PSI
+ * stall may need the full reboot.
+ */
+static void recovery_reboot(int cause)
+{
+    if (kexec_ready && (cause == CAUSE_HEARTBEAT_TIMEOUT || cause == CAUSE_CRASHING)) {
+        elog(ELOG_ERROR, "Rebooting with kexec");
+        reboot(LINUX_REBOOT_CMD_KEXEC);
+
+        // Only get here if the kexec failed
+        elog(ELOG_ERROR, "kexec failed: %s. Restarting normally.", strerror(errno));
+    }
+    reboot(LINUX_REBOOT_CMD_RESTART);
+}
+
+static void init_guarded_timeout()
+{
+    const char *env = get_env(HEART_GUARDED_TIMEOUT);
+    if (env) {
+        guarded_timeout = atoi(env);
+        if (guarded_timeout < 1) {
+            elog(ELOG_ERROR, "ignoring invalid " HEART_GUARDED_TIMEOUT " '%s'", env);
+            guarded_timeout = 0;
+        }
+    }
+}
+
+/*
+ * Called after PID 1 has been signaled for a guarded reboot, poweroff or halt.
+ */
+static void start_guarded_timeout(int cmd, const char *what, int64_t now_ms)
+{
+    if (guarded_timeout == 0)
+        return;
+
+    guarded_reboot_cmd = cmd;
+    guarded_what = what;
+    guarded_start_ms = now_ms;
+    guarded_deadline_ms = now_ms + guarded_timeout * 1000LL;
+}
+
+static void *sync_thread(void *arg)
+{
+    (void) arg;
+    sync();
+    return NULL;
+}
+
+/*
+ * Sync, but don't get stuck on a storage device that stopped responding. The
+ * sync is left running in the background if it takes too long. Returns 0 if
+ * the sync finished.
+ */
+static int bounded_sync()
+{
+    pthread_t tid;
+    if (start_storage_thread(&tid, sync_thread, NULL) < 0)
+        return 0;
+
+    return join_storage_thread(tid, GUARDED_SYNC_TIMEOUT);
+}
+
+/*
+ * PID 1 didn't finish the guarded reboot, poweroff or halt in time, so do it
+ * directly. The hardware watchdog is still the backstop if this fails.
+ */
+static void guarded_escalate(int64_t now_ms)
 {
-    return getenv(key);
-}
+    HEART_PROBE1(guarded_escalate, guarded_reboot_cmd);
+    elog(ELOG_ERROR, "Guarded %s not done after %lld ms. Syncing and doing it directly.",
+         guarded_what, (long long) (now_ms - guarded_start_ms));
 
+    int64_t sync_start_ms = timestamp_ms();
+    int rc = bounded_sync();
+    int64_t sync_end_ms = timestamp_ms();
+    elog(ELOG_ERROR, "Guarded %s sync %s after %lld ms", guarded_what, rc == 0 ? "done" : "timed out",
+         (long long) (sync_end_ms - sync_start_ms));
 
-static void set_default_logging_verbosity()
-{
-    // If logging to kmsg, then log more since kmsg supports log levels.
-    if (access("/dev/kmsg", W_OK) == 0)
-        elog_level = ELOG_LEVEL_INFO;
-    else
-        elog_level = ELOG_LEVEL_ERROR;
- }
+    reboot(guarded_reboot_cmd);
 
-static void set_logging_verbosity()
-{
-    const char *verbose_value = get_env(HEART_VERBOSE);
-    if (!verbose_value) {
-        set_default_logging_verbosity();
-        return;
-    }
+    elog(ELOG_ERROR, "Guarded %s failed: %s. Waiting for the WDT.", guarded_what, strerror(errno));
+    guarded_deadline_ms = 0;
+}
 
-    // Per Erlang heart documentation:
-    // 0 = no prints, 1 = important prints, 2 = informational prints
-    switch (atoi(verbose_value)) {
-    case 0:
-        elog_level = ELOG_LEVEL_EMERG;
-        break;
-    case 1:
-        set_default_logging_verbosity();
-        break;
-    default:
-        elog_level = ELOG_LEVEL_DEBUG;
-        break;
+/*
+ * Erlang is gone, but PID 1 may still finish. Wait for it until the deadline.
+ */
+static void wait_for_guarded_deadline()
+{
+    int64_t now_ms;
+    while ((now_ms = timestamp_ms()) < guarded_deadline_ms) {
+        int64_t left_ms = guarded_deadline_ms - now_ms;
+        struct timeval timeout = { left_ms / 1000, (left_ms % 1000) * 1000 };
+        select(0, NULL, NULL, NULL, &timeout);
     }
+    guarded_escalate(now_ms);
 }
 
-static void try_open_watchdog()
+static void snooze_signal_handler(int sig)
 {
-    /* The watchdog device sometimes takes a bit to appear, so give it a few tries. */
-    if (watchdog_fd >= 0)
-       return;
+    (void) sig;
+    snooze_requested = 1;
+}
 
-    if (watchdog_open_retries <= 0)
-       return;
+static void reexec_signal_handler(int sig)
+{
+    (void) sig;
+    reexec_requested = 1;
+}
 
-    char *watchdog_path = get_env(HEART_WATCHDOG_PATH);
-    if (watchdog_path == NULL)
-        watchdog_path = watchdog_path_default;
+/*
+ * Block or unblock the snooze and re-exec signals. They're blocked across a
+ * re-exec since the exec resets their handlers to the default, which
+ * terminates heart. Ones that come in before the new image installs its
+ * handlers stay pending until it unblocks them.
+ */
+static void mask_heart_signals(int how)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(how, &set, NULL);
+}
 
-    watchdog_fd = open(watchdog_path, O_WRONLY);
-    if (watchdog_fd >= 0) {
-        int real_wdt_timeout;
-        int set_wdt_timeout = 0;
-        int ret = 0;
-        char *kernel_timeout_env = get_env(HEART_KERNEL_TIMEOUT_ENV);
+/*
+ * Everything that the new image needs to carry on where the old one left
+ * off. The header is first and has a fixed layout so that an image with a
+ * different state layout can still keep the watchdog and the replies that
+ * Erlang hasn't read. The queue may end in a partly written reply, so
+ * dropping it would corrupt the stream to Erlang.
+ */
+struct reexec_state {
+    uint32_t magic;
+    uint32_t size;               /* sizeof(struct reexec_state) in the old image */
+    int32_t watchdog_fd;
+    int32_t watchdog_open_retries;
+    int32_t ack_pending;         /* 1 if a SET_CMD is waiting for an ack */
+    uint32_t reexec_count;
+    int64_t handoff_start_ms;
+    uint32_t outbound_queue_len;
+    char outbound_queue[OUTBOUND_QUEUE_SIZE];
+
+    int64_t start_ms;
+    int64_t last_heart_beat_time;
+    int64_t last_heart_beat_ms;
+    int64_t last_wdt_pet_time;
+    int64_t last_wdt_pet_ms;
+    int64_t init_handshake_end_time;
+    int64_t init_grace_end_time;
+    int64_t snooze_end_time;
+    int64_t gap_p999_ms;
+    int64_t last_gap_warning_time;
+    int32_t init_handshake_happened;
+    int32_t wdt_timeout;
+    int32_t wdt_pet_timeout;
+    int32_t wdt_timeleft_supported;
+    int32_t pet_lateness_ms;
+    int32_t wdt_drift_ppm;
+    int32_t heartbeat_late;
+    uint32_t heartbeat_late_count;
+    uint32_t first_heartbeat_ms;
+    uint32_t init_handshake_ms;
+    uint32_t gap_samples;
+    uint32_t gap_histogram[GAP_BUCKETS];
+    uint32_t outbound_queue_drops;
+};
 
-        if (kernel_timeout_env != NULL) {
-            struct watchdog_info info;
-            if (ioctl(watchdog_fd, WDIOC_GETSUPPORT, &info) == 0 &&
-                info.options & WDIOF_SETTIMEOUT) {
+#define REEXEC_HEADER_SIZE offsetof(struct reexec_state, start_ms)
 
-                set_wdt_timeout = atoi(kernel_timeout_env);
-                if (set_wdt_timeout >= MIN_WDT_PET_TIMEOUT &&
-                    set_wdt_timeout <= MAX_WDT_PET_TIMEOUT) {
-                    ret = ioctl(watchdog_fd, WDIOC_SETTIMEOUT, &set_wdt_timeout);
-                    if (ret == 0) {
-                        elog(ELOG_INFO, "kernel WDT timeout set to %ds", set_wdt_timeout);
-                    } else {
-                        elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ds (ioctl ret %d, errno %d: %s)",
-                                  set_wdt_timeout, ret, errno, strerror(errno));
-                    }
-                } else {
-                    elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ds (invalid range %d-%d)",
-                              set_wdt_timeout, MIN_WDT_PET_TIMEOUT, MAX_WDT_PET_TIMEOUT);
-                }
-            } else {
-                elog(ELOG_ERROR, "Failed to set kernel WDT timeout to %ss (not supported)", kernel_timeout_env);
-            }
-        }
+/* Used for handing off and then restoring. Static since it's big. */
+static struct reexec_state reexec_state_buffer;
 
-        ret = ioctl(watchdog_fd, WDIOC_GETTIMEOUT, &real_wdt_timeout);
-        if (ret == 0 && real_wdt_timeout >= MIN_WDT_PET_TIMEOUT) {
-            wdt_timeout = real_wdt_timeout;
-            /* Most of the time, pet WDT_PET_TIMEOUT_BUFFER seconds before the timeout,
-             * but if it's really short, then pet half the timeout.
-             */
-            if (real_wdt_timeout > 2*WDT_PET_TIMEOUT_BUFFER)
-                wdt_pet_timeout = real_wdt_timeout - WDT_PET_TIMEOUT_BUFFER;
-            else
-                wdt_pet_timeout = real_wdt_timeout / 2;
-        } else if (ret != 0) {
-            elog(ELOG_ERROR, "error or too short WDT timeout so using defaults!");
-        }
+/* The state that the old image handed off or NULL if this is a normal start */
+static struct reexec_state *restored_state = NULL;
 
-        elog(ELOG_INFO | ELOG_PMSG, "kernel watchdog activated. WDT timeout %ds, WDT pet interval %ds, VM timeout %ds, initial grace period %lds", wdt_timeout, wdt_pet_timeout, heart_beat_timeout, (long) init_grace_time);
-    } else {
-        watchdog_open_retries--;
-        if (watchdog_open_retries <= 0) {
-            elog(ELOG_ERROR, "can't open '%s'. Running without kernel watchdog: %s", watchdog_path, strerror(errno));
-            wdt_timeout = wdt_pet_timeout = 60*60*24*365;
-        }
+/*
+ * Replace heart with a new run of its executable without a gap in petting
+ * the WDT or in heartbeat accounting. The state goes into a memfd and the WDT,
+ * stdin and stdout stay open across the exec. If the binary was replaced,
+ * like by a firmware update, the new one runs. This only returns on error.
+ */
+static void reexec(int64_t now_ms, int ack_pending)
+{
+    if (guarded_deadline_ms) {
+        elog(ELOG_ERROR, "Not re-exec'ing during a guarded %s", guarded_what);
         return;
     }
-}
-
-static void pet_watchdog(time_t now)
-{
-    try_open_watchdog();
 
-    if (watchdog_fd >= 0) {
-        if (write(watchdog_fd, "\0", 1) >= 0) {
-            last_wdt_pet_time = now;
-        } else {
-            elog(ELOG_ERROR, "error petting watchdog: %s", strerror(errno));
+    char path[PATH_MAX];
+#ifdef __linux__
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len < 0) {
+        elog(ELOG_ERROR, "can't find heart's executable to re-exec: %s", strerror(errno));
+        return;
+    }
+    path[len] = '\0';
+
+    // Run the replacement if the executable was updated
+    static const char deleted[] = " (deleted)";
+    if (len > (ssize_t) strlen(deleted) && strcmp(path + len - strlen(deleted), deleted) == 0)
+        path[len - strlen(deleted)] = '\0';
+
+    int fd = memfd_create("heart_state", 0);
+#else
+    // No /proc/self/exe or memfds, so use the path that heart was started
+    // with and an unlinked temporary file
+    snprintf(path, sizeof(path), "%s", heart_argv[0]);
+
+    char state_path[] = "/tmp/heart_stateXXXXXX";
+    int fd = mkstemp(state_path);
+    if (fd >= 0)
+        unlink(state_path);
+#endif
+    if (fd < 0) {
+        elog(ELOG_ERROR, "can't create re-exec state: %s", strerror(errno));
+        return;
+    }
 
-            // Retry next time if there is a next time.
-            close(watchdog_fd);
-            watchdog_fd = -1;
-        }
+    elog(ELOG_INFO | ELOG_PMSG, "Re-exec'ing %s", path);
+
+    // Hold the lock so that the pet thread doesn't pet or close the WDT while exec'ing
+    pthread_mutex_lock(&watchdog_lock);
+
+    struct reexec_state *state = &reexec_state_buffer;
+    memset(state, 0, sizeof(*state));
+    state->magic = REEXEC_MAGIC;
+    state->size = sizeof(*state);
+    state->watchdog_fd = watchdog_fd;
+    state->watchdog_open_retries = watchdog_open_retries;
+    state->ack_pending = ack_pending;
+    state->reexec_count = reexec_count + 1;
+    state->handoff_start_ms = now_ms;
+    state->start_ms = start_ms;
+    state->last_heart_beat_time = last_heart_beat_time;
+    state->last_heart_beat_ms = last_heart_beat_ms;
+    state->last_wdt_pet_time = last_wdt_pet_time;
+    state->last_wdt_pet_ms = last_wdt_pet_ms;
+    state->init_handshake_end_time = init_handshake_end_time;
+    state->init_grace_end_time = init_grace_end_time;
+    state->snooze_end_time = snooze_end_time;
+    state->gap_p999_ms = gap_p999_ms;
+    state->last_gap_warning_time = last_gap_warning_time;
+    state->init_handshake_happened = init_handshake_happened;
+    state->wdt_timeout = wdt_timeout;
+    state->wdt_pet_timeout = wdt_pet_timeout;
+    state->wdt_timeleft_supported = wdt_timeleft_supported;
+    state->pet_lateness_ms = pet_lateness_ms;
+    state->wdt_drift_ppm = wdt_drift_ppm;
+    state->heartbeat_late = heartbeat_late;
+    state->heartbeat_late_count = heartbeat_late_count;
+    state->first_heartbeat_ms = first_heartbeat_ms;
+    state->init_handshake_ms = init_handshake_ms;
+    state->gap_samples = gap_samples;
+    memcpy(state->gap_histogram, gap_histogram, sizeof(gap_histogram));
+    state->outbound_queue_drops = outbound_queue_drops;
+    state->outbound_queue_len = outbound_queue_len;
+    memcpy(state->outbound_queue, outbound_queue, outbound_queue_len);
+
+    char fd_str[16];
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    if (pwrite(fd, state, sizeof(*state), 0) == sizeof(*state) &&
+        setenv(HEART_REEXEC_STATE, fd_str, 1) == 0) {
+        mask_heart_signals(SIG_BLOCK);
+        execve(path, heart_argv, environ);
     }
+
+    int err = errno;
+    mask_heart_signals(SIG_UNBLOCK);
+    pthread_mutex_unlock(&watchdog_lock);
+    elog(ELOG_ERROR, "re-exec failed: %s", strerror(err));
+    unsetenv(HEART_REEXEC_STATE);
+    close(fd);
 }
 
 /*
- *  main
+ * Load the state from the old image if this is a re-exec. The WDT is
+ * restored now so that it isn't opened again and the outbound queue is
+ * restored before anything else is sent to Erlang. The timers are restored
+ * once the message loop starts.
  */
-static void get_arguments(int argc, char **argv)
+static void load_reexec_state()
 {
-    int i = 1;
-    int h = -1;
-    unsigned long p = 0;
+    struct reexec_state *state = &reexec_state_buffer;
 
-    while (i < argc) {
-        switch (argv[i][0]) {
-        case '-':
-            switch (argv[i][1]) {
-            case 'h':
-                if (strcmp(argv[i], "-ht") == 0)
-                    if (sscanf(argv[i + 1], "%i", &h) == 1)
-                        if ((h > 10) && (h <= 65535)) {
-                            heart_beat_timeout = h;
-                            i++;
-                        }
-                break;
-            case 'p':
-                if (strcmp(argv[i], "-pid") == 0)
-                    if (sscanf(argv[i + 1], "%lu", &p) == 1) {
-                        heart_beat_kill_pid = p;
-                        i++;
-                    }
-                break;
-            default:
-                ;
-            }
-            break;
-        default:
-            ;
-        }
-        i++;
+    const char *fd_env = get_env(HEART_REEXEC_STATE);
+    if (!fd_env)
+        return;
+
+    int fd = atoi(fd_env);
+    unsetenv(HEART_REEXEC_STATE);
+
+    ssize_t len = pread(fd, state, sizeof(*state), 0);
+    close(fd);
+    if (len < (ssize_t) REEXEC_HEADER_SIZE || state->magic != REEXEC_MAGIC) {
+        elog(ELOG_ERROR, "can't read re-exec state, so starting over");
+        return;
+    }
+
+    watchdog_fd = state->watchdog_fd;
+    watchdog_open_retries = state->watchdog_open_retries;
+    reexec_count = state->reexec_count;
+    if (state->outbound_queue_len <= OUTBOUND_QUEUE_SIZE) {
+        memcpy(outbound_queue, state->outbound_queue, state->outbound_queue_len);
+        outbound_queue_len = state->outbound_queue_len;
+    }
+
+    if (len != sizeof(*state) || state->size != sizeof(*state)) {
+        // Only the header is usable. Timers start over, but that's safe.
+        elog(ELOG_WARNING | ELOG_PMSG, "re-exec state is from a different version, so only keeping the WDT and replies");
+        state->size = REEXEC_HEADER_SIZE;
+    } else {
+        wdt_timeout = state->wdt_timeout;
+        wdt_pet_timeout = state->wdt_pet_timeout;
+        wdt_timeleft_supported = state->wdt_timeleft_supported;
+        pet_lateness_ms = state->pet_lateness_ms;
+        wdt_drift_ppm = state->wdt_drift_ppm;
     }
+    restored_state = state;
 }
 
-static void stop_petting_watchdog()
+/*
+ * Pick up the timers and heartbeat accounting from the old image
+ */
+static void restore_reexec_timers(int64_t now_ms)
 {
-    // Stop petting of the hardware watchdog by forgetting the
-    // file handle and marking that there are no retries left to
-    // open it. Do not close the file handle since that might
-    // tell Linux to disable the watchdog if the kernel doesn't
-    // have CONFIG_WDT_NOWAYOUT=y.
-    watchdog_open_retries = 0;
-    watchdog_fd = -1;
+    const struct reexec_state *state = restored_state;
+
+    if (state->size == sizeof(*state)) {
+        start_ms = state->start_ms;
+        last_heart_beat_time = state->last_heart_beat_time;
+        last_heart_beat_ms = state->last_heart_beat_ms;
+        last_wdt_pet_time = state->last_wdt_pet_time;
+        last_wdt_pet_ms = state->last_wdt_pet_ms;
+        init_handshake_end_time = state->init_handshake_end_time;
+        init_grace_end_time = state->init_grace_end_time;
+        snooze_end_time = state->snooze_end_time;
+        gap_p999_ms = state->gap_p999_ms;
+        last_gap_warning_time = state->last_gap_warning_time;
+        init_handshake_happened = state->init_handshake_happened;
+        heartbeat_late = state->heartbeat_late;
+        heartbeat_late_count = state->heartbeat_late_count;
+        first_heartbeat_ms = state->first_heartbeat_ms;
+        init_handshake_ms = state->init_handshake_ms;
+        gap_samples = state->gap_samples;
+        memcpy(gap_histogram, state->gap_histogram, sizeof(gap_histogram));
+        outbound_queue_drops = state->outbound_queue_drops;
+    }
 
-    // Set the pet timeout out really long so that if control
-    // ends up in the select loop, the WDT pet timeout won't
-    // exit select early.
-    wdt_pet_timeout = 86400;
+    reexec_handoff_ms = now_ms - state->handoff_start_ms;
+    elog(ELOG_INFO | ELOG_PMSG, "Re-exec handoff took %lld ms", (long long) reexec_handoff_ms);
+    HEART_PROBE1(reexec_done, reexec_handoff_ms);
 }
 
-static void snooze_signal_handler(int sig)
+static void init_watchdog_lock()
 {
-    (void) sig;
-    snooze_requested = 1;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+#ifdef _POSIX_THREAD_PRIO_INHERIT
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+#endif
+    pthread_mutex_init(&watchdog_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
 
 int main(int argc, char **argv)
 {
+    init_watchdog_lock();
     set_logging_verbosity();
+    set_pmsg_format();
 
     elog(ELOG_INFO | ELOG_PMSG, PROGRAM_NAME " " PROGRAM_VERSION_STR);
 
@@ -455,9 +2388,35 @@ int main(int argc, char **argv)
     }
 
     signal(SIGUSR1, snooze_signal_handler);
+    signal(SIGUSR2, reexec_signal_handler);
+    mask_heart_signals(SIG_UNBLOCK);
 
+    heart_argv = argv;
     get_arguments(argc, argv);
-    notify_ack();
+    load_reexec_state();
+    init_low_power();
+    init_adaptive_pet();
+    init_kexec();
+    init_guarded_timeout();
+    start_pet_thread();
+    init_psi();
+    init_vm_monitor();
+    init_ledger();
+    init_boot_times();
+    harden();
+
+    const char *gap_env = get_env(HEART_GAP_WARNING_PERCENT);
+    if (gap_env) {
+        gap_warning_percent = atoi(gap_env);
+        if (gap_warning_percent < 1 || gap_warning_percent > 100)
+            gap_warning_percent = DEFAULT_GAP_WARNING_PERCENT;
+    }
+    set_stdout_nonblocking();
+
+    // After a re-exec, Erlang is only waiting for an ack if it asked for the
+    // re-exec. It goes after any replies that the old image hadn't sent yet.
+    if (!restored_state || restored_state->ack_pending)
+        notify_ack();
 
     do_terminate(message_loop());
 
@@ -474,22 +2433,41 @@ static int message_loop()
 {
     int   i;
     time_t now;
+    int64_t now_ms;
     fd_set read_fds;
+    fd_set write_fds;
+    fd_set except_fds;
     int   max_fd;
     struct timeval timeout;
     int   tlen;           /* total message length */
     struct msg m;
+    size_t r;
+    int in_grace_period;
+    int snoozing = 0;
 
     // Initialize timestamps
-    now = last_heart_beat_time = last_wdt_pet_time = snooze_end_time = timestamp_seconds();
+    now_ms = start_ms = last_heart_beat_ms = timestamp_ms();
+    now = last_heart_beat_time = last_wdt_pet_time = snooze_end_time = now_ms / 1000;
     init_handshake_end_time = now + init_handshake_timeout;
     init_grace_end_time = now + init_grace_time;
     last_heart_beat_time = init_grace_end_time;
+    in_grace_period = init_grace_time > 0;
+    wakeup_window_start = now;
+
+    if (restored_state) {
+        restore_reexec_timers(now_ms);
+        in_grace_period = now < init_grace_end_time;
+        snoozing = now < snooze_end_time;
+    }
 
     // Pet the hw watchdog on start since we don't know how long it has been
     pet_watchdog(now);
 
-    max_fd = STDIN_FILENO;
+    max_fd = max(STDIN_FILENO, STDOUT_FILENO);
+    for (r = 0; r < PSI_RESOURCE_COUNT; r++) {
+        if (psi_resources[r].trigger)
+            max_fd = max(max_fd, psi_resources[r].fd);
+    }
 
     while (1) {
         if (snooze_requested) {
@@ -498,18 +2476,61 @@ static int message_loop()
             init_handshake_happened = 1;
             last_heart_beat_time = snooze_end_time = now + 15 * 60;
             snooze_requested = 0;
+            snoozing = 1;
+            flight_record(FLIGHT_SNOOZE, now_ms, 15 * 60);
+            HEART_PROBE1(snooze_start, snooze_end_time);
+        }
+
+        if (reexec_requested) {
+            reexec_requested = 0;
+            reexec(timestamp_ms(), 0);
         }
 
         /* Prepare to block on select */
         FD_ZERO(&read_fds);
         FD_SET(STDIN_FILENO, &read_fds);
-        timeout.tv_sec = max(1, min(last_heart_beat_time + heart_beat_timeout - now, last_wdt_pet_time + wdt_pet_timeout - now));
+        FD_ZERO(&write_fds);
+        if (outbound_queue_len > 0)
+            FD_SET(STDOUT_FILENO, &write_fds);
+        FD_ZERO(&except_fds);
+        for (r = 0; r < PSI_RESOURCE_COUNT; r++) {
+            if (psi_resources[r].trigger)
+                FD_SET(psi_resources[r].fd, &except_fds);
+        }
+        if (pet_thread_running) {
+            update_pet_thread_healthy_until();
+            timeout.tv_sec = max(1, last_heart_beat_time + heart_beat_timeout - now);
+
+            // Only the main loop opens the WDT, so keep waking up to retry if
+            // it hasn't shown up yet
+            if (watchdog_needs_open())
+                timeout.tv_sec = min(timeout.tv_sec, max(1, last_wdt_pet_time + wdt_pet_timeout - now));
+        } else {
+            timeout.tv_sec = max(1, min(last_heart_beat_time + heart_beat_timeout - now, last_wdt_pet_time + wdt_pet_timeout - now));
+        }
         timeout.tv_usec = 0;
 
         if (!init_handshake_happened)
             timeout.tv_sec = min(timeout.tv_sec, init_handshake_end_time - now);
 
-        if ((i = select(max_fd + 1, &read_fds, NULLFDS, NULLFDS, &timeout)) < 0) {
+        // Late heartbeats are still noticed in low power mode, but not on time.
+        // They're not checked at all while snoozing or in the grace period.
+        if (!heartbeat_late && !low_power && now >= snooze_end_time && now >= init_grace_end_time) {
+            int64_t warning_ms = last_heart_beat_ms + gap_warning_ms() - now_ms;
+            timeout.tv_sec = min(timeout.tv_sec, max(1, (warning_ms + 999) / 1000));
+        }
+
+        pthread_mutex_lock(&watchdog_lock);
+        time_t flush_time = flight_flush_time();
+        pthread_mutex_unlock(&watchdog_lock);
+        if (flush_time)
+            timeout.tv_sec = min(timeout.tv_sec, max(1, flush_time - now));
+
+        if (guarded_deadline_ms)
+            timeout.tv_sec = min(timeout.tv_sec, max(1, (guarded_deadline_ms - now_ms + 999) / 1000));
+
+        HEART_PROBE2(select_timeout, timeout.tv_sec, outbound_queue_len);
+        if ((i = select(max_fd + 1, &read_fds, &write_fds, &except_fds, &timeout)) < 0) {
             if (errno == EINTR)
                 continue;
 
@@ -517,31 +2538,63 @@ static int message_loop()
             return R_ERROR;
         }
 
-        now = timestamp_seconds();
+        now_ms = timestamp_ms();
+        now = now_ms / 1000;
+        count_wakeup(now);
+
+        if (guarded_deadline_ms && now_ms >= guarded_deadline_ms)
+            guarded_escalate(now_ms);
 
         if (now >= last_heart_beat_time + heart_beat_timeout) {
             elog(ELOG_ERROR, "heartbeat timeout -> no activity for %lu seconds",
                   (unsigned long) (now - last_heart_beat_time));
+            termination_cause = CAUSE_HEARTBEAT_TIMEOUT;
             return R_TIMEOUT;
         }
 
         if (!init_handshake_happened && now >= init_handshake_end_time) {
             elog(ELOG_ERROR, "init handshake never happened -> not received in %lu seconds",
                   (unsigned long) init_handshake_timeout);
+            termination_cause = CAUSE_INIT_HANDSHAKE_TIMEOUT;
+            return R_TIMEOUT;
+        }
+
+        if (i > 0 && FD_ISSET(STDOUT_FILENO, &write_fds))
+            flush_outbound_queue();
+
+        if (i > 0 && psi_stalled_too_long(&except_fds, now)) {
+            termination_cause = CAUSE_PSI_STALL;
             return R_TIMEOUT;
         }
 
+        check_heartbeat_gap(now_ms, now);
+        check_flight_recorder(now_ms, now);
+
+        if (in_grace_period && now >= init_grace_end_time) {
+            flight_record(FLIGHT_GRACE_END, now_ms, 0);
+            HEART_PROBE(grace_end);
+            in_grace_period = 0;
+        }
+        if (snoozing && now >= snooze_end_time) {
+            flight_record(FLIGHT_SNOOZE_END, now_ms, 0);
+            HEART_PROBE(snooze_end);
+            snoozing = 0;
+        }
+
         /*
          * Do not check fd-bits if select timeout
          */
         if (i == 0) {
-            pet_watchdog(now);
+            // Select also times out for late heartbeat warnings, so only pet when it's time.
+            // With the pet thread, this is only to retry opening the WDT.
+            if ((!pet_thread_running || watchdog_needs_open()) && now >= last_wdt_pet_time + wdt_pet_timeout)
+                pet_watchdog(now);
             continue;
         }
 
         if (now < snooze_end_time || now < init_grace_end_time) {
             // If snoozing or keeping the device alive for a minimum amount of time, unconditionally pet the hardware watchdog.
-            pet_watchdog(now);
+            pet_watchdog_on_activity(now);
         }
 
         /*
@@ -555,9 +2608,14 @@ static int message_loop()
             if ((tlen > MSG_HDR_SIZE) && (tlen <= MSG_TOTAL_SIZE)) {
                 int mp_len = htons(m.len);
 
+                HEART_PROBE2(message_receive, m.op, mp_len);
+
                 switch (m.op) {
                 case HEART_BEAT:
-                    pet_watchdog(now);
+                    pet_watchdog_on_activity(now);
+                    sample_vm(now);
+                    record_heartbeat_gap(now_ms);
+                    boot_time_milestone(&first_heartbeat_ms, now_ms);
                     // Snoozing and the initial grace period set
                     // last_heart_beat_time to a future time.
                     if (last_heart_beat_time < now)
@@ -573,51 +2631,80 @@ static int message_loop()
                          */
                         elog(ELOG_ERROR, "Received 'disable_hw' so no longer petting the hardware watchdog. System should reboot momentarily.");
 
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_DISABLE_HW);
+                        ledger_record(CAUSE_DISABLE_HW, now);
                         stop_petting_watchdog();
                     } else if (mp_len == 11 && memcmp(m.fill, "disable_vm", 10) == 0) {
                         /* If the user specifies "disable_vm", return like there was a timeout */
                         elog(ELOG_ERROR, "Received 'disable_vm' so exiting with a timeout. System should reboot momentarily.");
 
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_DISABLE_VM);
                         notify_ack();
+                        termination_cause = CAUSE_DISABLE_VM;
                         return R_TIMEOUT;
                     } else if (mp_len == 15 && memcmp(m.fill, "guarded_reboot", 14) == 0) {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_GUARDED_REBOOT);
+                        ledger_record(CAUSE_GUARDED_REBOOT, now);
                         pet_watchdog(now);
                         stop_petting_watchdog();
                         kill(1, SIGTERM); // SIGTERM signals "reboot" to PID 1
+                        start_guarded_timeout(LINUX_REBOOT_CMD_RESTART, "reboot", now_ms);
 
                         elog(ELOG_INFO | ELOG_PMSG, "Guarded reboot requested. No longer petting the WDT");
-                        sync();
+                        if (bounded_sync() < 0)
+                            elog(ELOG_ERROR | ELOG_PMSG, "Guarded reboot sync timed out");
                     } else if (mp_len == 25 && memcmp(m.fill, "guarded_immediate_reboot", 24) == 0) {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_GUARDED_IMMEDIATE_REBOOT);
+                        ledger_record(CAUSE_GUARDED_IMMEDIATE_REBOOT, now);
                         stop_petting_watchdog();
+                        wait_for_ring_files();
                         reboot(LINUX_REBOOT_CMD_RESTART);
 
                         elog(ELOG_INFO | ELOG_PMSG, "Guarded immediate reboot requested. No longer petting the WDT");
                      } else if (mp_len == 17 && memcmp(m.fill, "guarded_poweroff", 16) == 0) {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_GUARDED_POWEROFF);
+                        ledger_record(CAUSE_GUARDED_POWEROFF, now);
                         pet_watchdog(now);
                         stop_petting_watchdog();
                         kill(1, SIGUSR2); // SIGUSR2 signals "poweroff" to PID 1
+                        start_guarded_timeout(LINUX_REBOOT_CMD_POWER_OFF, "poweroff", now_ms);
 
                         elog(ELOG_INFO | ELOG_PMSG, "Guarded poweroff requested. No longer petting the WDT");
-                        sync();
+                        if (bounded_sync() < 0)
+                            elog(ELOG_ERROR | ELOG_PMSG, "Guarded poweroff sync timed out");
                     } else if (mp_len == 27 && memcmp(m.fill, "guarded_immediate_poweroff", 26) == 0) {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_GUARDED_IMMEDIATE_POWEROFF);
+                        ledger_record(CAUSE_GUARDED_IMMEDIATE_POWEROFF, now);
                         stop_petting_watchdog();
+                        wait_for_ring_files();
                         reboot(LINUX_REBOOT_CMD_POWER_OFF);
 
                         elog(ELOG_INFO | ELOG_PMSG, "Guarded immediate poweroff requested. No longer petting the WDT");
                     } else if (mp_len == 13 && memcmp(m.fill, "guarded_halt", 12) == 0) {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_GUARDED_HALT);
+                        ledger_record(CAUSE_GUARDED_HALT, now);
                         pet_watchdog(now);
                         stop_petting_watchdog();
                         kill(1, SIGUSR1); // SIGUSR1 signals "halt" to PID 1
+                        start_guarded_timeout(LINUX_REBOOT_CMD_HALT, "halt", now_ms);
 
                         elog(ELOG_INFO | ELOG_PMSG, "Guarded halt requested. No longer petting the WDT");
-                        sync();
+                        if (bounded_sync() < 0)
+                            elog(ELOG_ERROR | ELOG_PMSG, "Guarded halt sync timed out");
                     } else if (mp_len == 15 && memcmp(m.fill, "init_handshake", 14) == 0) {
                         /* Application has said that it's completed initialization */
                         elog(ELOG_INFO | ELOG_PMSG, "Received init handshake");
+                        flight_record(FLIGHT_INIT_HANDSHAKE, now_ms, 0);
                         init_handshake_happened = 1;
+                        boot_time_milestone(&init_handshake_ms, now_ms);
+                    } else if (mp_len == 7 && memcmp(m.fill, "reexec", 6) == 0) {
+                        // The new image sends the ack
+                        reexec(now_ms, 1);
                     } else if (mp_len == 7 && memcmp(m.fill, "snooze", 6) == 0) {
                         elog(ELOG_WARNING | ELOG_PMSG, "Snoozing heart keepalive checks for 15 minutes");
                         snooze_requested = 1;
+                    } else {
+                        flight_record(FLIGHT_SET_CMD, now_ms, CAUSE_NONE);
                     }
                     notify_ack();
                     break;
@@ -694,10 +2781,36 @@ kill_old_erlang(int reason)
 static void
 do_terminate(int reason)
 {
+    HEART_PROBE1(terminate, reason);
+
+    // Policy decisions are done, so don't let the pet thread pet any more
+    atomic_store(&pet_thread_healthy_until, 0);
+
+    if (termination_cause == CAUSE_NONE) {
+        switch (reason) {
+        case R_CLOSED: termination_cause = CAUSE_CLOSED; break;
+        case R_CRASHING: termination_cause = CAUSE_CRASHING; break;
+        case R_SHUT_DOWN: termination_cause = CAUSE_SHUT_DOWN; break;
+        case R_TIMEOUT: termination_cause = CAUSE_HEARTBEAT_TIMEOUT; break;
+        default: termination_cause = CAUSE_ERROR; break;
+        }
+    }
+    ledger_record(termination_cause, timestamp_seconds());
+    flight_recorder_flush(timestamp_ms());
+    HEART_PROBE1(terminate_recorded, termination_cause);
+
+    // Last try at getting replies to Erlang like the ack for disable_vm
+    flush_outbound_queue();
+
+    // Erlang exiting is expected after a guarded reboot, but PID 1 may not finish
+    if (guarded_deadline_ms && (reason == R_SHUT_DOWN || reason == R_CLOSED))
+        wait_for_guarded_deadline();
+
     switch (reason) {
     case R_SHUT_DOWN:
         // Pet watchdog to give remainder of graceful shutdown code time to run
         pet_watchdog(0);
+        wait_for_ring_files();
         break;
     case R_CRASHING:
         // Pet watchdog to avoid unintended WDT reset during crash
@@ -706,6 +2819,7 @@ do_terminate(int reason)
             const char *tmo_env = get_env(ERL_CRASH_DUMP_SECONDS_ENV);
             int tmo = atoi(tmo_env);
             elog(ELOG_ERROR, "waiting for dump - timeout set to %d seconds.", tmo);
+            HEART_PROBE1(terminate_crash_dump_wait, tmo);
             wait_until_close_write_or_env_tmo(tmo);
         }
     /* fall through */
@@ -713,9 +2827,14 @@ do_terminate(int reason)
     case R_CLOSED:
     case R_ERROR:
     default:
+        log_vm_stats();
+        wait_for_ring_files();
+        HEART_PROBE(terminate_sync);
         sync();
+        HEART_PROBE(terminate_kill);
         kill_old_erlang(reason);
-        reboot(LINUX_REBOOT_CMD_RESTART);
+        HEART_PROBE(terminate_reboot);
+        recovery_reboot(termination_cause);
         break;
     } /* switch(reason) */
 }
@@ -763,34 +2882,88 @@ static int notify_ack()
 
     m.op = HEART_ACK;
     m.len = htons(1);
-    return write_message(STDOUT_FILENO, &m);
+    return write_message(&m);
 }
 
 
+/*
+ *  flush_outbound_queue
+ *
+ *  Writes as much of the outbound queue to standard output as it takes
+ *  without blocking. Partially written messages stay at the front of the
+ *  queue so that Erlang never sees a truncated message.
+ */
+static void flush_outbound_queue()
+{
+    while (outbound_queue_len > 0) {
+        ssize_t n = write(STDOUT_FILENO, outbound_queue, outbound_queue_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // Erlang is gone. Reading stdin will find out.
+                elog(ELOG_ERROR, "error writing to Erlang: %s", strerror(errno));
+                outbound_queue_len = 0;
+            }
+            return;
+        }
+        outbound_queue_len -= n;
+        memmove(outbound_queue, outbound_queue + n, outbound_queue_len);
+    }
+}
+
 /*
  *  write_message
  *
- *  Writes a message to a blocking file descriptor. Returns the total
- *  size of the message written (always > 0), or -1 if error.
+ *  Queues a message for Erlang and sends as much as possible without
+ *  blocking. Returns the total size of the message (always > 0), or -1
+ *  if it was dropped since the queue was full.
  *
  *  A message which is too short or too long, is not written. The return
  *  value is then MSG_HDR_SIZE (2), as if the message had been written.
  *  Is this really necessary? Can't we assume that the length is ok?
  *  FIXME.
  */
-static int write_message(int fd, const struct msg *mp)
+static int write_message(const struct msg *mp)
 {
     int len = ntohs(mp->len);
 
     if ((len == 0) || (len > MSG_BODY_SIZE)) {
         return MSG_HDR_SIZE;
-    }             /* cc68k wants (char *) */
-    if (write(fd, (const char *) mp, len + MSG_HDR_SIZE) != len + MSG_HDR_SIZE) {
+    }
+    if (outbound_queue_len + len + MSG_HDR_SIZE > sizeof(outbound_queue)) {
+        outbound_queue_drops++;
         return -1;
     }
+    memcpy(outbound_queue + outbound_queue_len, mp, len + MSG_HDR_SIZE);
+    outbound_queue_len += len + MSG_HDR_SIZE;
+
+    flush_outbound_queue();
     return len + MSG_HDR_SIZE;
 }
 
+/*
+ * Make writes to Erlang non-blocking. O_NONBLOCK is a property of the open
+ * file, not the descriptor, so it's seen by everything else sharing it. That's
+ * why this is only done when stdout is a pipe from the Erlang VM and not a
+ * console or log file that may also be stderr or the VM's own output. It's
+ * also not done if stdin and stdout are the same file since reads need to
+ * block.
+ */
+static void set_stdout_nonblocking()
+{
+    struct stat in_stat, out_stat;
+    if (fstat(STDIN_FILENO, &in_stat) < 0 || fstat(STDOUT_FILENO, &out_stat) < 0 ||
+        !S_ISFIFO(out_stat.st_mode) ||
+        (in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino))
+        return;
+
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags < 0 || fcntl(STDOUT_FILENO, F_SETFL, flags | O_NONBLOCK) < 0)
+        elog(ELOG_ERROR, "can't make stdout non-blocking: %s", strerror(errno));
+}
+
 /*
  *  read_message
  *
@@ -876,7 +3049,7 @@ static int read_skip(int fd, char *buf, int maxlen, int len)
     return len;
 }
 
-time_t timestamp_seconds()
+int64_t timestamp_ms()
 {
     struct timespec ts;
     if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
@@ -884,7 +3057,55 @@ time_t timestamp_seconds()
         exit(EXIT_FAILURE);
     }
 
-    return ts.tv_sec;
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+time_t timestamp_seconds()
+{
+    return timestamp_ms() / 1000;
+}
+
+/*
+ * Append the 10 second stall averages to the status. The format of the
+ * /proc/pressure files is:
+ *
+ *  some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ *  full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+ */
+static char *psi_info(char *p, char *end, time_t now)
+{
+    size_t i;
+    for (i = 0; i < PSI_RESOURCE_COUNT; i++) {
+        struct psi_resource *r = &psi_resources[i];
+        if (r->fd < 0)
+            continue;
+
+        char buffer[256];
+        ssize_t len = pread(r->fd, buffer, sizeof(buffer) - 1, 0);
+        if (len < 0)
+            len = 0;
+        buffer[len] = '\0';
+
+        char *line = buffer;
+        char kind[8];
+        char avg10[16];
+        while (sscanf(line, "%7s avg10=%15s", kind, avg10) == 2) {
+            p = append(p, end, "psi_%s_%s=%s\n", r->name, kind, avg10);
+
+            line = strchr(line, '\n');
+            if (!line)
+                break;
+            line++;
+        }
+    }
+
+    if (psi_threshold > 0) {
+        int stall_time = 0;
+        if (psi_stall_start != 0 && now - psi_last_event <= PSI_STALL_GAP)
+            stall_time = now - psi_stall_start;
+        p = append(p, end, "psi_stall_time=%d\n", stall_time);
+    }
+    return p;
 }
 
 static int heart_cmd_info_reply(time_t now)
@@ -892,11 +3113,15 @@ static int heart_cmd_info_reply(time_t now)
     struct msg m;
     struct watchdog_info info;
     char *p = (char *) m.fill;
-    int ret;
-    int flags;
+    char *end = p + MSG_BODY_SIZE;
 
     int heartbeat_time_left = last_heart_beat_time + heart_beat_timeout - now;
+    pthread_mutex_lock(&watchdog_lock);
     int wdt_pet_time_left = last_wdt_pet_time + wdt_pet_timeout - now;
+    int wdt_pet_interval = wdt_pet_timeout;
+    int32_t wdt_pet_lateness_ms = pet_lateness_ms;
+    int32_t wdt_drift = wdt_drift_ppm;
+    pthread_mutex_unlock(&watchdog_lock);
     int init_handshake_time_left = init_handshake_end_time - now;
     if (init_handshake_happened || init_handshake_time_left < 0)
         init_handshake_time_left = 0;
@@ -907,7 +3132,7 @@ static int heart_cmd_info_reply(time_t now)
      *  <KEY>=<VALUE> NEWLINE
      *  ...
      */
-    p += sprintf(p, "program_name=" PROGRAM_NAME "\nprogram_version=" PROGRAM_VERSION_STR "\n"
+    p = append(p, end, "program_name=" PROGRAM_NAME "\nprogram_version=" PROGRAM_VERSION_STR "\n"
         "heartbeat_timeout=%d\n"
         "heartbeat_time_left=%d\n"
         "init_grace_time_left=%d\n"
@@ -915,53 +3140,88 @@ static int heart_cmd_info_reply(time_t now)
         "wdt_pet_time_left=%d\n"
         "init_handshake_happened=%d\n"
         "init_handshake_timeout=%d\n"
-        "init_handshake_time_left=%d\n",
+        "init_handshake_time_left=%d\n"
+        "heartbeat_gap_p999=%lld\n"
+        "heartbeat_late=%d\n"
+        "heartbeat_late_count=%u\n"
+        "outbound_queue_bytes=%u\n"
+        "outbound_queue_drops=%u\n"
+        "wakeups_per_hour=%u\n"
+        "wdt_pet_interval=%d\n"
+        "wdt_pet_margin=%d\n"
+        "wdt_pet_lateness_ms=%d\n"
+        "wdt_drift_ppm=%d\n"
+        "reexec_count=%u\n"
+        "reexec_handoff_ms=%lld\n",
         heart_beat_timeout, heartbeat_time_left, init_grace_time_time_left, snooze_time_left, wdt_pet_time_left,
-        init_handshake_happened, (int) init_handshake_timeout, init_handshake_time_left);
-
-    ret = ioctl(watchdog_fd, WDIOC_GETSUPPORT, &info);
-    if (ret == 0) {
-        p += sprintf(p, "wdt_identity=%s\n", info.identity);
-        p += sprintf(p, "wdt_firmware_version=%u\n", info.firmware_version);
-        p += sprintf(p, "wdt_options=");
-        if (info.options & WDIOF_OVERHEAT) p += sprintf(p, "overheat,");
-        if (info.options & WDIOF_FANFAULT) p += sprintf(p, "fanfault,");
-        if (info.options & WDIOF_EXTERN1) p += sprintf(p, "extern1,");
-        if (info.options & WDIOF_EXTERN2) p += sprintf(p, "extern2,");
-        if (info.options & WDIOF_POWERUNDER) p += sprintf(p, "powerunder,");
-        if (info.options & WDIOF_CARDRESET) p += sprintf(p, "cardreset,");
-        if (info.options & WDIOF_POWEROVER) p += sprintf(p, "powerover,");
-        if (info.options & WDIOF_SETTIMEOUT) p += sprintf(p, "settimeout,");
-        if (info.options & WDIOF_MAGICCLOSE) p += sprintf(p, "magicclose,");
-        if (info.options & WDIOF_PRETIMEOUT) p += sprintf(p, "pretimeout,");
-        if (info.options & WDIOF_ALARMONLY) p += sprintf(p, "alarmonly,");
-        if (info.options & WDIOF_KEEPALIVEPING) p += sprintf(p, "keepaliveping,");
-        p += sprintf(p, "\n");
+        init_handshake_happened, (int) init_handshake_timeout, init_handshake_time_left,
+        gap_samples >= GAP_MIN_SAMPLES ? (long long) gap_p999_ms : 0LL, heartbeat_late, heartbeat_late_count,
+        (unsigned int) outbound_queue_len, outbound_queue_drops, wakeups_per_hour(),
+        wdt_pet_interval, wdt_timeout - wdt_pet_interval, wdt_pet_lateness_ms, wdt_drift,
+        reexec_count, (long long) reexec_handoff_ms);
+
+    // The pet thread closes the WDT on pet errors, so hold the lock for the
+    // ioctls. They're quick like the pet thread's own WDIOC_GETTIMELEFT.
+    int support_ret, time_left, pre_timeout, boot_status, timeout;
+    pthread_mutex_lock(&watchdog_lock);
+    support_ret = ioctl(watchdog_fd, WDIOC_GETSUPPORT, &info);
+    if (ioctl(watchdog_fd, WDIOC_GETTIMELEFT, &time_left) != 0)
+        time_left = 0;
+    if (ioctl(watchdog_fd, WDIOC_GETPRETIMEOUT, &pre_timeout) != 0)
+        pre_timeout = 0;
+    boot_status = 0;
+    if (ioctl(watchdog_fd, WDIOC_GETBOOTSTATUS, &boot_status) != 0)
+        boot_status = 0;
+    timeout = wdt_timeout;
+    pthread_mutex_unlock(&watchdog_lock);
+
+    if (support_ret == 0) {
+        p = append(p, end, "wdt_identity=%s\n", info.identity);
+        p = append(p, end, "wdt_firmware_version=%u\n", info.firmware_version);
+        p = append(p, end, "wdt_options=");
+        if (info.options & WDIOF_OVERHEAT) p = append(p, end, "overheat,");
+        if (info.options & WDIOF_FANFAULT) p = append(p, end, "fanfault,");
+        if (info.options & WDIOF_EXTERN1) p = append(p, end, "extern1,");
+        if (info.options & WDIOF_EXTERN2) p = append(p, end, "extern2,");
+        if (info.options & WDIOF_POWERUNDER) p = append(p, end, "powerunder,");
+        if (info.options & WDIOF_CARDRESET) p = append(p, end, "cardreset,");
+        if (info.options & WDIOF_POWEROVER) p = append(p, end, "powerover,");
+        if (info.options & WDIOF_SETTIMEOUT) p = append(p, end, "settimeout,");
+        if (info.options & WDIOF_MAGICCLOSE) p = append(p, end, "magicclose,");
+        if (info.options & WDIOF_PRETIMEOUT) p = append(p, end, "pretimeout,");
+        if (info.options & WDIOF_ALARMONLY) p = append(p, end, "alarmonly,");
+        if (info.options & WDIOF_KEEPALIVEPING) p = append(p, end, "keepaliveping,");
+        p = append(p, end, "\n");
     } else {
-        p += sprintf(p, "wdt_identity=none\nwdt_firmware_version=0\nwdt_options=\n");
+        p = append(p, end, "wdt_identity=none\nwdt_firmware_version=0\nwdt_options=\n");
     }
 
-    ret = ioctl(watchdog_fd, WDIOC_GETTIMELEFT, &flags);
-    if (ret != 0)
-        flags = 0;
-    p += sprintf(p, "wdt_time_left=%u\n", flags);
-
-    ret = ioctl(watchdog_fd, WDIOC_GETPRETIMEOUT, &flags);
-    if (ret != 0)
-        flags = 0;
-    p += sprintf(p, "wdt_pre_timeout=%u\n", flags);
-
-    p += sprintf(p, "wdt_timeout=%u\n", wdt_timeout);
-
-    flags = 0;
-    ret = ioctl(watchdog_fd, WDIOC_GETBOOTSTATUS, &flags);
-    if (ret != 0)
-        flags = 0;
-    p += sprintf(p, "wdt_last_boot=%s\n", (flags != 0 ? "watchdog" : "power_on"));
+    p = append(p, end, "wdt_time_left=%u\n", time_left);
+    p = append(p, end, "wdt_pre_timeout=%u\n", pre_timeout);
+    p = append(p, end, "wdt_timeout=%u\n", timeout);
+    p = append(p, end, "wdt_last_boot=%s\n", (boot_status != 0 ? "watchdog" : "power_on"));
+
+    p = psi_info(p, end, now);
+    p = ledger_info(p, end);
+    p = boot_times_info(p, end);
+
+    struct vm_sample sample;
+    struct vm_rates rates;
+    if (current_vm_stats(now, &sample, &rates) == 0) {
+        p = append(p, end, "vm_cpu=%d\n"
+            "vm_rss=%ld\n"
+            "vm_rss_growth=%ld\n"
+            "vm_swap=%ld\n"
+            "vm_major_faults=%ld\n"
+            "vm_threads=%ld\n"
+            "vm_run_delay=%d\n",
+            rates.cpu, sample.rss_kb, vm_rss_growth, sample.swap_kb, rates.major_faults, sample.threads,
+            rates.run_delay);
+    }
 
     size_t len = p - (char *) m.fill;
     m.op = HEART_CMD;
     m.len = htons(len + 1);   /* Include Op */
 
-    return write_message(STDOUT_FILENO, &m);
+    return write_message(&m);
 }
@@ -0,0 +1,35 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: Apache-2.0
+//
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// Static tracepoints
+//
+// When built with systemtap's <sys/sdt.h>, these are USDT probes that perf,
+// bpftrace and friends can attach to. A probe is a nop instruction and a note
+// in the ELF file, so they cost nothing until something attaches. Without
+// <sys/sdt.h> or with HEART_NO_PROBES defined, they compile to nothing.
+//
+// All probes use the "nerves_heart" provider. See the README for the list.
+
+#if !defined(HEART_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HEART_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef HEART_PROBES_ENABLED
+#define HEART_PROBE(name) DTRACE_PROBE(nerves_heart, name)
+#define HEART_PROBE1(name, a) DTRACE_PROBE1(nerves_heart, name, a)
+#define HEART_PROBE2(name, a, b) DTRACE_PROBE2(nerves_heart, name, a, b)
+#else
+#define HEART_PROBE(name) do {} while (0)
+#define HEART_PROBE1(name, a) do { (void) (a); } while (0)
+#define HEART_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#endif
+
+#endif // PROBES_H
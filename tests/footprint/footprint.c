@@ -0,0 +1,225 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// Measure the footprint of heart binaries
+//
+// Each binary is started a few times like Erlang would start it. The time to
+// the first HEART_ACK is measured and then a heartbeat and status request are
+// sent to exercise the main loop before asking heart to shut down. The peak
+// RSS and page faults come from the exit's resource usage.
+//
+// Heart is pointed at /dev/null for its watchdog so that this is safe to run
+// on a development machine.
+
+#include <err.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_RUNS 32
+
+struct result {
+    long size;
+    long startup_us;
+    long max_rss_kb;
+    long min_flt;
+    long maj_flt;
+};
+
+static long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static int read_exactly(int fd, unsigned char *buf, int len)
+{
+    int got = 0;
+    while (got < len) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 5000) <= 0)
+            return -1;
+
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return got;
+}
+
+static int read_message(int fd)
+{
+    unsigned char buf[4096];
+    if (read_exactly(fd, buf, 2) < 0)
+        return -1;
+
+    int len = (buf[0] << 8) | buf[1];
+    if (len > (int) sizeof(buf))
+        return -1;
+    return read_exactly(fd, buf, len);
+}
+
+static void send_op(int fd, unsigned char op)
+{
+    unsigned char msg[3] = { 0, 1, op };
+    if (write(fd, msg, sizeof(msg)) != sizeof(msg))
+        err(EXIT_FAILURE, "write");
+}
+
+static int compare_longs(const void *a, const void *b)
+{
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static int run_once(const char *path, struct result *r, long *startup_us)
+{
+    int to_heart[2];
+    int from_heart[2];
+    if (pipe(to_heart) < 0 || pipe(from_heart) < 0)
+        err(EXIT_FAILURE, "pipe");
+
+    long start = now_us();
+    pid_t pid = fork();
+    if (pid < 0)
+        err(EXIT_FAILURE, "fork");
+
+    if (pid == 0) {
+        dup2(to_heart[0], STDIN_FILENO);
+        dup2(from_heart[1], STDOUT_FILENO);
+        close(to_heart[0]);
+        close(to_heart[1]);
+        close(from_heart[0]);
+        close(from_heart[1]);
+
+        setenv("HEART_WATCHDOG_PATH", "/dev/null", 1);
+        setenv("HEART_VERBOSE", "0", 1);
+        setenv("HEART_NO_KILL", "TRUE", 1);
+        execl(path, path, "-ht", "60", (char *) NULL);
+        _exit(127);
+    }
+    close(to_heart[0]);
+    close(from_heart[1]);
+
+    int ok = read_message(from_heart[0]) == 1;
+    *startup_us = now_us() - start;
+
+    if (ok) {
+        send_op(to_heart[1], 2); // HEART_BEAT
+        send_op(to_heart[1], 6); // GET_CMD
+        ok = read_message(from_heart[0]) > 1;
+        send_op(to_heart[1], 3); // SHUT_DOWN
+    }
+    if (!ok)
+        kill(pid, SIGKILL);
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+        err(EXIT_FAILURE, "wait4");
+    close(to_heart[1]);
+    close(from_heart[0]);
+
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        warnx("%s didn't run as expected", path);
+        return -1;
+    }
+
+    if (ru.ru_maxrss > r->max_rss_kb)
+        r->max_rss_kb = ru.ru_maxrss;
+    if (ru.ru_minflt > r->min_flt)
+        r->min_flt = ru.ru_minflt;
+    if (ru.ru_majflt > r->maj_flt)
+        r->maj_flt = ru.ru_majflt;
+    return 0;
+}
+
+static int measure(const char *path, int runs, struct result *r)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        warn("%s", path);
+        return -1;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->size = st.st_size;
+
+    long startup_us[MAX_RUNS];
+    for (int i = 0; i < runs; i++) {
+        if (run_once(path, r, &startup_us[i]) < 0)
+            return -1;
+    }
+
+    qsort(startup_us, runs, sizeof(long), compare_longs);
+    r->startup_us = startup_us[runs / 2];
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: footprint [--runs n] [--max-size bytes] [--max-rss kb] heart...\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"runs", required_argument, 0, 'n'},
+        {"max-size", required_argument, 0, 's'},
+        {"max-rss", required_argument, 0, 'r'},
+        {0, 0, 0, 0}
+    };
+    int runs = 5;
+    long max_size = 0;
+    long max_rss = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:s:r:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'n': runs = atoi(optarg); break;
+        case 's': max_size = atol(optarg); break;
+        case 'r': max_rss = atol(optarg); break;
+        default: usage();
+        }
+    }
+    if (optind >= argc || runs < 1 || runs > MAX_RUNS)
+        usage();
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int rc = EXIT_SUCCESS;
+    printf("%-24s %10s %12s %12s %8s %8s\n", "binary", "size(B)", "startup(us)", "max_rss(kB)", "minflt", "majflt");
+    for (int i = optind; i < argc; i++) {
+        struct result r;
+        if (measure(argv[i], runs, &r) < 0) {
+            rc = EXIT_FAILURE;
+            continue;
+        }
+
+        printf("%-24s %10ld %12ld %12ld %8ld %8ld\n", argv[i], r.size, r.startup_us, r.max_rss_kb, r.min_flt, r.maj_flt);
+
+        if (max_size > 0 && r.size > max_size) {
+            warnx("%s: size %ld > %ld bytes", argv[i], r.size, max_size);
+            rc = EXIT_FAILURE;
+        }
+        if (max_rss > 0 && r.max_rss_kb > max_rss) {
+            warnx("%s: max RSS %ld > %ld kB", argv[i], r.max_rss_kb, max_rss);
+            rc = EXIT_FAILURE;
+        }
+    }
+    return rc;
+}
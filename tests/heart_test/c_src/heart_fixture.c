@@ -18,10 +18,21 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 #include <sys/un.h>
+#include <linux/reboot.h>
 #include <linux/watchdog.h>
 
 #ifndef __APPLE__
@@ -46,12 +57,157 @@
 #define REPLACE(ret, name, args) OVERRIDE(ret, name, args)
 #endif
 
-// Special file handle for watchdog operations
+// Special file handles for watchdog operations. /dev/watchdogN is
+// WATCHDOG_FILENO + N.
 #define WATCHDOG_FILENO 9999
+#define WDT_DEVICES     4
+
+// Special file handle for pmsg breadcrumbs when HEART_REPORT_PMSG is set
+#define PMSG_FILENO 9998
 
 static int to_elixir_fd = -1;
 static int open_tries = 0;
 static int wdt_timeout = 0;
+static const char *fake_root = NULL;
+static int report_pmsg = 0;
+static const char *pmsg_path = NULL;
+
+// Re-exec
+//
+// The fixture stays loaded when heart re-execs itself. Its state, including
+// the virtual clock and watchdogs, is handed to the new image in
+// HEART_FIXTURE_STATE so that tests see one continuous run. The socket to
+// Elixir stays open across the exec.
+//
+// A "signal_after_exec SIGUSR1" or "signal_after_exec SIGUSR2" control message
+// sends that signal to the new image before heart's main() runs like one that
+// comes in the middle of the exec.
+static char preload_path[PATH_MAX];
+static int exec_signal = 0;
+
+// Options for benchmarking with the pet jitter harness
+static int real_sched = 0;
+
+// Report heap allocations once heart says that it's done with them
+static int report_allocations = 0;
+
+// PSI triggers
+//
+// Files under /proc/pressure come from the fake root. Writes to them register
+// triggers and get reported instead of changing the file. A "psi <resource>"
+// control message fires the trigger on the next select.
+#define PSI_RESOURCES 3
+static const char *psi_names[PSI_RESOURCES] = { "cpu", "memory", "io" };
+static int psi_fds[PSI_RESOURCES] = { -1, -1, -1 };
+static int psi_pending[PSI_RESOURCES] = { 0, 0, 0 };
+
+// Stalled stdout
+//
+// A "stall_stdout on" control message makes heart's stdout act like Erlang
+// stopped reading it. Writes return EAGAIN and select never says that it's
+// writable until "stall_stdout off".
+static int stdout_stalled = 0;
+
+// Stuck storage
+//
+// A "stall_sync on" control message makes sync() and fdatasync() block like
+// they do when a storage device stops responding. They return after
+// "stall_sync off".
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static int sync_stalled = 0;
+
+// Simulated watchdogs
+//
+// Each /dev/watchdogN counts down from its last pet like the Linux watchdog
+// core. Opening starts it. Writes, WDIOC_KEEPALIVE and WDIOC_SETTIMEOUT pet
+// it. Closing only stops it if 'V' was written (magic close) and
+// HEART_WDT_NOWAYOUT isn't set. A timeout of 0 never expires so that bogus
+// timeouts can be tested.
+//
+// Pets are reported as "pet(<bytes>) margin=<ms>" where the margin is how long
+// the watchdog had left. If a watchdog expires, "wdt_reset(<path>)" is
+// reported and the process exits like the board reset.
+//
+// "wdt_rate <percent>" makes the countdowns run faster or slower than nominal
+// like a drifting watchdog clock, and "pet_delay <ms>" makes each pet take
+// that long on the virtual clock like a slow external watchdog.
+// "pet_error <errno>" makes the next pet fail.
+struct wdt_device {
+    int open;
+    int running;
+    int expect_close;
+    int timeout;
+    int64_t last_pet_ns;
+};
+
+static struct wdt_device wdt_devices[WDT_DEVICES];
+static int wdt_nowayout = 0;
+static int wdt_rate = 100;
+static int pet_delay_ms = 0;
+static int pet_error = 0;
+
+// Syscall counts
+//
+// Every interposed call is counted by type. A "syscalls" control message
+// reports the counts since the last one as "syscalls(<name>=<count> ...)" and
+// starts over so that tests can check how much work heart does. Calls that
+// the fixture makes itself aren't counted.
+enum {
+    SC_CLOCK_GETTIME,
+    SC_CLOSE,
+    SC_EXECVE,
+    SC_FCNTL,
+    SC_FDATASYNC,
+    SC_FSTAT,
+    SC_GETDENTS,
+    SC_IOCTL,
+    SC_KILL,
+    SC_LSEEK,
+    SC_MLOCKALL,
+    SC_NANOSLEEP,
+    SC_OPEN,
+    SC_OPENAT,
+    SC_PREAD,
+    SC_PWRITE,
+    SC_READ,
+    SC_REBOOT,
+    SC_SCHED,
+    SC_SELECT,
+    SC_SLEEP,
+    SC_SYNC,
+    SC_WRITE,
+    SC_COUNT
+};
+
+static const char *syscall_names[SC_COUNT] = {
+    "clock_gettime", "close", "execve", "fcntl", "fdatasync", "fstat", "getdents", "ioctl",
+    "kill", "lseek", "mlockall", "nanosleep", "open", "openat", "pread", "pwrite", "read",
+    "reboot", "sched", "select", "sleep", "sync", "write"
+};
+static unsigned int syscall_counts[SC_COUNT];
+
+static inline void count_syscall(int which)
+{
+    // The pet thread makes calls too
+    __atomic_fetch_add(&syscall_counts[which], 1, __ATOMIC_RELAXED);
+}
+
+// Virtual clock
+//
+// When HEART_VIRTUAL_CLOCK is set, CLOCK_MONOTONIC, select and sleep don't
+// use real time. Time only moves forward when Elixir sends an "advance"
+// message over the control socket. The blocking calls run instantly up to
+// the point that Elixir has allowed and then report back with a "clock"
+// message once heart is idle again.
+#define NS_PER_SEC 1000000000LL
+#define NS_PER_MS  1000000LL
+
+static int virtual_clock = 0;
+static int64_t virtual_now = 1000 * NS_PER_SEC;
+static int64_t virtual_limit = 1000 * NS_PER_SEC;
+static unsigned long advance_seq = 0;
+static unsigned long acked_seq = 0;
 
 static void flog(const char *format, ...)
 {
@@ -63,28 +219,175 @@ static void flog(const char *format, ...)
     int count = vsnprintf(buffer, sizeof(buffer), format, ap);
     va_end(ap);
 
+    if (count >= (int) sizeof(buffer))
+        count = sizeof(buffer) - 1;
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"
      (void) write(to_elixir_fd, buffer, count);
 #pragma GCC diagnostic pop
 }
 
+static int64_t monotonic_ns(void);
+
+static struct wdt_device *wdt_device(int fd)
+{
+    int index = fd - WATCHDOG_FILENO;
+    if (index < 0 || index >= WDT_DEVICES || !wdt_devices[index].open)
+        return NULL;
+    return &wdt_devices[index];
+}
+
+static int64_t wdt_expiry_ns(const struct wdt_device *d)
+{
+    return d->last_pet_ns + d->timeout * NS_PER_SEC * 100 / wdt_rate;
+}
+
+// Returns the earliest time that a watchdog expires or INT64_MAX
+static int64_t next_wdt_expiry_ns(void)
+{
+    int64_t next = INT64_MAX;
+    for (int i = 0; i < WDT_DEVICES; i++) {
+        struct wdt_device *d = &wdt_devices[i];
+        if (d->running && d->timeout > 0 && wdt_expiry_ns(d) < next)
+            next = wdt_expiry_ns(d);
+    }
+    return next;
+}
+
+// Reset the "board" if a watchdog expired by the time `now`
+static void check_wdt_expiry(int64_t now)
+{
+    for (int i = 0; i < WDT_DEVICES; i++) {
+        struct wdt_device *d = &wdt_devices[i];
+        if (d->running && d->timeout > 0 && now >= wdt_expiry_ns(d)) {
+            flog("wdt_reset(/dev/watchdog%d)", i);
+            exit(0);
+        }
+    }
+}
+
+static void wdt_pet(struct wdt_device *d)
+{
+    d->last_pet_ns = monotonic_ns();
+    d->running = 1;
+}
+
+static int wdt_open(const char *pathname)
+{
+    int index = atoi(pathname + 13);
+    if (index < 0 || index >= WDT_DEVICES) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    struct wdt_device *d = &wdt_devices[index];
+    if (d->open) {
+        // Only one opener at a time like the kernel
+        errno = EBUSY;
+        return -1;
+    }
+    // Opening starts a stopped watchdog, but doesn't pet a running one
+    if (!d->running) {
+        d->timeout = wdt_timeout;
+        wdt_pet(d);
+    }
+    d->open = 1;
+    d->expect_close = 0;
+    return WATCHDOG_FILENO + index;
+}
+
+static void wdt_close(struct wdt_device *d)
+{
+    int index = d - wdt_devices;
+    if (d->expect_close && !wdt_nowayout) {
+        d->running = 0;
+        flog("close(/dev/watchdog%d) stopped", index);
+    } else {
+        flog("close(/dev/watchdog%d) not stopped", index);
+    }
+    d->open = 0;
+}
+
+static int restore_fixture_state(const char *state)
+{
+    int offset;
+    if (sscanf(state, "%d %" SCNd64 " %" SCNd64 " %lu %lu %d %d %d %d%n", &to_elixir_fd, &virtual_now, &virtual_limit,
+               &advance_seq, &acked_seq, &stdout_stalled, &wdt_rate, &pet_delay_ms, &exec_signal, &offset) != 9)
+        return -1;
+
+    for (int i = 0; i < WDT_DEVICES; i++) {
+        struct wdt_device *d = &wdt_devices[i];
+        int len;
+        state += offset;
+        if (sscanf(state, " %d %d %d %d %" SCNd64 "%n", &d->open, &d->running, &d->expect_close, &d->timeout,
+                   &d->last_pet_ns, &len) != 5)
+            return -1;
+        offset = len;
+    }
+    return 0;
+}
+
 __attribute__((constructor)) void fixture_init(void)
 {
     char *report_path = getenv("HEART_REPORT_PATH");
     if (!report_path)
         errx(EXIT_FAILURE, "Must specify HEART_REPORT_PATH");
 
+    char *control_path = getenv("HEART_CONTROL_PATH");
+    virtual_clock = getenv("HEART_VIRTUAL_CLOCK") != NULL;
+    if (virtual_clock && !control_path)
+        errx(EXIT_FAILURE, "Must specify HEART_CONTROL_PATH with HEART_VIRTUAL_CLOCK");
+
     char *open_tries_string = getenv("HEART_WATCHDOG_OPEN_TRIES");
     open_tries = open_tries_string ? atoi(open_tries_string) : 0;
     char *wdt_timeout_string = getenv("WDT_TIMEOUT");
     wdt_timeout = wdt_timeout_string ? atoi(wdt_timeout_string) : 120;
+    wdt_nowayout = getenv("HEART_WDT_NOWAYOUT") != NULL;
+    fake_root = getenv("HEART_FAKE_ROOT");
+    report_pmsg = getenv("HEART_REPORT_PMSG") != NULL;
+    pmsg_path = getenv("HEART_PMSG_PATH");
+    real_sched = getenv("HEART_REAL_SCHED") != NULL;
+
+#ifdef __APPLE__
+    const char *preload = getenv("DYLD_INSERT_LIBRARIES");
+#else
+    const char *preload = getenv("LD_PRELOAD");
+#endif
+    if (preload)
+        strncpy(preload_path, preload, sizeof(preload_path) - 1);
+
+    const char *state = getenv("HEART_FIXTURE_STATE");
+    if (state) {
+        if (restore_fixture_state(state) < 0)
+            errx(EXIT_FAILURE, "fixture can't restore its state after exec");
+        unsetenv("HEART_FIXTURE_STATE");
+        unsetenv("LD_PRELOAD");
+        unsetenv("DYLD_INSERT_LIBRARIES");
+
+        if (exec_signal) {
+            flog("raise(%s)", exec_signal == SIGUSR1 ? "SIGUSR1" : "SIGUSR2");
+            raise(exec_signal);
+            exec_signal = 0;
+        }
+        return;
+    }
 
     to_elixir_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (to_elixir_fd < 0)
         err(EXIT_FAILURE, "socket");
 
     struct sockaddr_un addr;
+    if (control_path) {
+        // Bind so that Elixir has an address to send control messages to
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+        unlink(control_path);
+        if (bind(to_elixir_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+            err(EXIT_FAILURE, "fixture can't bind %s", control_path);
+    }
+
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
     strncpy(addr.sun_path, report_path, sizeof(addr.sun_path) - 1);
@@ -97,19 +400,50 @@ __attribute__((constructor)) void fixture_init(void)
     unsetenv("DYLD_INSERT_LIBRARIES");
 }
 
+static void wait_for_storage(void)
+{
+    pthread_mutex_lock(&sync_lock);
+    while (sync_stalled)
+        pthread_cond_wait(&sync_cond, &sync_lock);
+    pthread_mutex_unlock(&sync_lock);
+}
+
 REPLACE(void, sync, (void))
 {
+    count_syscall(SC_SYNC);
     flog("sync()");
+    wait_for_storage();
+}
+
+// Like the kernel, kexec only works if a kernel was loaded. Tests can
+// "unload" it by changing the fake /sys/kernel/kexec_loaded.
+static int kexec_loaded()
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/sys/kernel/kexec_loaded", fake_root ? fake_root : "");
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    int loaded = fgetc(fp) == '1';
+    fclose(fp);
+    return loaded;
 }
 
 REPLACE(int, reboot, (int cmd))
 {
+    count_syscall(SC_REBOOT);
     flog("reboot(0x%08x)", cmd);
+    if (cmd == LINUX_REBOOT_CMD_KEXEC && !kexec_loaded()) {
+        errno = EINVAL;
+        return -1;
+    }
     exit(0);
 }
 
 REPLACE(int, kill, (pid_t pid, int sig))
 {
+    count_syscall(SC_KILL);
     const char *signal_name;
     switch (sig) {
     case SIGTERM: signal_name = "SIGTERM"; break;
@@ -125,25 +459,388 @@ REPLACE(int, kill, (pid_t pid, int sig))
 
 OVERRIDE(ssize_t, write, (int fildes, const void *buf, size_t nbyte))
 {
-    if (fildes == WATCHDOG_FILENO) {
-        flog("pet(%d)", (int) nbyte);
+    // flog() writes to the report socket
+    if (fildes != to_elixir_fd)
+        count_syscall(SC_WRITE);
+
+    struct wdt_device *d = wdt_device(fildes);
+    if (d) {
+        if (virtual_clock)
+            virtual_now += pet_delay_ms * NS_PER_MS;
+        int64_t now = monotonic_ns();
+        check_wdt_expiry(now);
+
+        if (pet_error) {
+            flog("pet(%d) failed", (int) nbyte);
+            errno = pet_error;
+            pet_error = 0;
+            return -1;
+        }
+
+        if (d->timeout > 0)
+            flog("pet(%d) margin=%lld", (int) nbyte, (long long) (wdt_expiry_ns(d) - now) / NS_PER_MS);
+        else
+            flog("pet(%d)", (int) nbyte);
+        d->expect_close = memchr(buf, 'V', nbyte) != NULL;
+        wdt_pet(d);
         return nbyte;
     }
 
+    if (fildes == PMSG_FILENO) {
+        // Skip the wall clock timestamp and program name and trim the newline
+        const char *msg = memchr(buf, ' ', nbyte);
+        msg = msg ? memchr(msg + 1, ' ', nbyte - (msg + 1 - (const char *) buf)) : NULL;
+        if (msg) {
+            msg++;
+            int len = nbyte - (msg - (const char *) buf);
+            if (len > 0 && msg[len - 1] == '\n')
+                len--;
+            flog("pmsg(%.*s)", len, msg);
+        }
+        return nbyte;
+    }
+
+    for (int i = 0; i < PSI_RESOURCES; i++) {
+        if (fildes == psi_fds[i]) {
+            flog("psi_trigger(%s, %.*s)", psi_names[i], (int) strnlen(buf, nbyte), (const char *) buf);
+            return nbyte;
+        }
+    }
+
+    if (fildes == STDOUT_FILENO && stdout_stalled) {
+        errno = EAGAIN;
+        return -1;
+    }
+
     return ORIGINAL(write)(fildes, buf, nbyte);
 }
 
+static int real_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout);
+
+static void report_syscalls(void)
+{
+    char counts[224] = "";
+    size_t len = 0;
+
+    for (int i = 0; i < SC_COUNT; i++) {
+        unsigned int count = __atomic_exchange_n(&syscall_counts[i], 0, __ATOMIC_RELAXED);
+        if (count > 0 && len < sizeof(counts))
+            len += snprintf(counts + len, sizeof(counts) - len, "%s%s=%u", len ? " " : "", syscall_names[i], count);
+    }
+    flog("syscalls(%s)", counts);
+}
+
+static void process_control_message(const char *msg)
+{
+    unsigned long seq;
+    long long ms;
+    char name[16];
+
+    if (sscanf(msg, "advance %lu %lld", &seq, &ms) == 2) {
+        if (virtual_limit < virtual_now)
+            virtual_limit = virtual_now;
+        virtual_limit += ms * NS_PER_MS;
+        advance_seq = seq;
+    } else if (sscanf(msg, "wdt_rate %d", &wdt_rate) == 1) {
+    } else if (sscanf(msg, "pet_delay %d", &pet_delay_ms) == 1) {
+    } else if (sscanf(msg, "pet_error %d", &pet_error) == 1) {
+    } else if (strcmp(msg, "syscalls") == 0) {
+        report_syscalls();
+    } else if (sscanf(msg, "stall_stdout %15s", name) == 1) {
+        stdout_stalled = strcmp(name, "on") == 0;
+    } else if (sscanf(msg, "signal_after_exec %15s", name) == 1) {
+        exec_signal = strcmp(name, "SIGUSR1") == 0 ? SIGUSR1 : SIGUSR2;
+    } else if (sscanf(msg, "stall_sync %15s", name) == 1) {
+        pthread_mutex_lock(&sync_lock);
+        sync_stalled = strcmp(name, "on") == 0;
+        pthread_cond_broadcast(&sync_cond);
+        pthread_mutex_unlock(&sync_lock);
+    } else if (sscanf(msg, "psi %15s", name) == 1) {
+        for (int i = 0; i < PSI_RESOURCES; i++) {
+            if (strcmp(name, psi_names[i]) == 0)
+                psi_pending[i] = 1;
+        }
+    } else {
+        flog("unknown control message '%s'", msg);
+    }
+}
+
+static void process_control_messages(void)
+{
+    char buffer[64];
+    ssize_t len;
+
+    while ((len = recv(to_elixir_fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT)) > 0) {
+        buffer[len] = '\0';
+        process_control_message(buffer);
+    }
+}
+
+static void copy_fds(fd_set *to, const fd_set *from)
+{
+    if (from)
+        memcpy(to, from, sizeof(fd_set));
+    else
+        FD_ZERO(to);
+}
+
+static int count_and_return_fds(int nfds, fd_set *set, fd_set *out)
+{
+    int count = 0;
+    for (int fd = 0; fd < nfds; fd++) {
+        if (FD_ISSET(fd, set))
+            count++;
+    }
+    if (out)
+        memcpy(out, set, sizeof(fd_set));
+    return count;
+}
+
+// The pet thread's nanosleep is on the virtual clock too. When time moves
+// past its deadline, the main thread wakes it and waits for it to go back to
+// sleep so that everything that happens at a virtual time has happened before
+// Elixir hears that heart is idle.
+static pthread_mutex_t sleeper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleeper_cond = PTHREAD_COND_INITIALIZER;
+static int64_t sleeper_deadline = 0; // 0 when no thread is sleeping
+static int sleeper_awake = 0;
+
+static void run_sleepers_until(int64_t t)
+{
+    pthread_mutex_lock(&sleeper_lock);
+    while (sleeper_deadline && sleeper_deadline <= t) {
+        if (next_wdt_expiry_ns() <= sleeper_deadline) {
+            virtual_now = next_wdt_expiry_ns();
+            check_wdt_expiry(virtual_now);
+        }
+        if (virtual_now < sleeper_deadline)
+            virtual_now = sleeper_deadline;
+
+        sleeper_deadline = 0;
+        sleeper_awake = 1;
+        pthread_cond_broadcast(&sleeper_cond);
+        while (sleeper_awake)
+            pthread_cond_wait(&sleeper_cond, &sleeper_lock);
+    }
+    pthread_mutex_unlock(&sleeper_lock);
+}
+
+static int virtual_nanosleep(const struct timespec *req)
+{
+    pthread_mutex_lock(&sleeper_lock);
+    sleeper_deadline = virtual_now + req->tv_sec * NS_PER_SEC + req->tv_nsec;
+    sleeper_awake = 0;
+    pthread_cond_broadcast(&sleeper_cond);
+    while (!sleeper_awake)
+        pthread_cond_wait(&sleeper_cond, &sleeper_lock);
+    pthread_mutex_unlock(&sleeper_lock);
+    return 0;
+}
+
+static int virtual_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
+{
+    int64_t deadline = virtual_now + timeout->tv_sec * NS_PER_SEC + timeout->tv_usec * 1000LL;
+    int idle = 0;
+
+    for (;;) {
+        fd_set r, w, e;
+        struct timeval zero = {0, 0};
+
+        copy_fds(&r, readfds);
+        copy_fds(&w, writefds);
+        copy_fds(&e, errorfds);
+        FD_SET(to_elixir_fd, &r);
+        if (stdout_stalled)
+            FD_CLR(STDOUT_FILENO, &w);
+
+        int max_fd = nfds > to_elixir_fd + 1 ? nfds : to_elixir_fd + 1;
+        int rc = real_select(max_fd, &r, &w, &e, idle ? NULL : &zero);
+        if (rc < 0)
+            return rc;
+
+        if (FD_ISSET(to_elixir_fd, &r)) {
+            FD_CLR(to_elixir_fd, &r);
+            rc--;
+            process_control_messages();
+        }
+
+        for (int i = 0; i < PSI_RESOURCES; i++) {
+            if (psi_pending[i] && psi_fds[i] >= 0 && errorfds && FD_ISSET(psi_fds[i], errorfds)) {
+                psi_pending[i] = 0;
+                FD_SET(psi_fds[i], &e);
+                rc++;
+            }
+        }
+
+        if (rc > 0) {
+            // Something happened at the current virtual time
+            int64_t left = deadline - virtual_now;
+            timeout->tv_sec = left / NS_PER_SEC;
+            timeout->tv_usec = (left % NS_PER_SEC) / 1000;
+            return count_and_return_fds(nfds, &r, readfds) +
+                   count_and_return_fds(nfds, &w, writefds) +
+                   count_and_return_fds(nfds, &e, errorfds);
+        }
+
+        if (deadline <= virtual_limit) {
+            // The timeout happens before the time that Elixir allowed
+            run_sleepers_until(deadline);
+            if (next_wdt_expiry_ns() <= deadline) {
+                virtual_now = next_wdt_expiry_ns();
+                check_wdt_expiry(virtual_now);
+            }
+            if (virtual_now < deadline)
+                virtual_now = deadline;
+            timeout->tv_sec = 0;
+            timeout->tv_usec = 0;
+            if (readfds) FD_ZERO(readfds);
+            if (writefds) FD_ZERO(writefds);
+            if (errorfds) FD_ZERO(errorfds);
+            return 0;
+        }
+
+        // Idle until Elixir sends a message or advances time
+        run_sleepers_until(virtual_limit);
+        if (next_wdt_expiry_ns() <= virtual_limit) {
+            virtual_now = next_wdt_expiry_ns();
+            check_wdt_expiry(virtual_now);
+        }
+        if (virtual_now < virtual_limit)
+            virtual_now = virtual_limit;
+        if (acked_seq != advance_seq) {
+            flog("clock(%lu)", advance_seq);
+            acked_seq = advance_seq;
+        }
+        idle = 1;
+    }
+}
+
 OVERRIDE(int, select, (int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout))
 {
+    count_syscall(SC_SELECT);
     if (timeout == NULL || timeout->tv_sec > 86400) {
         flog("Bad timeout passed to select!");
         return -1;
     }
+    if (virtual_clock)
+        return virtual_select(nfds, readfds, writefds, errorfds, timeout);
+
     return ORIGINAL(select)(nfds, readfds, writefds, errorfds, timeout);
 }
 
+static int real_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *errorfds, struct timeval *timeout)
+{
+    return ORIGINAL(select)(nfds, readfds, writefds, errorfds, timeout);
+}
+
+OVERRIDE(int, clock_gettime, (clockid_t clk_id, struct timespec *tp))
+{
+    count_syscall(SC_CLOCK_GETTIME);
+    if (virtual_clock && clk_id == CLOCK_MONOTONIC) {
+        tp->tv_sec = virtual_now / NS_PER_SEC;
+        tp->tv_nsec = virtual_now % NS_PER_SEC;
+        return 0;
+    }
+    return ORIGINAL(clock_gettime)(clk_id, tp);
+}
+
+static int64_t monotonic_ns(void)
+{
+    if (virtual_clock)
+        return virtual_now;
+
+    struct timespec ts;
+    ORIGINAL(clock_gettime)(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+OVERRIDE(ssize_t, read, (int fd, void *buf, size_t count))
+{
+    count_syscall(SC_READ);
+    return ORIGINAL(read)(fd, buf, count);
+}
+
+OVERRIDE(ssize_t, pread, (int fd, void *buf, size_t count, off_t offset))
+{
+    count_syscall(SC_PREAD);
+    return ORIGINAL(pread)(fd, buf, count, offset);
+}
+
+OVERRIDE(ssize_t, pwrite, (int fd, const void *buf, size_t count, off_t offset))
+{
+    count_syscall(SC_PWRITE);
+    return ORIGINAL(pwrite)(fd, buf, count, offset);
+}
+
+OVERRIDE(off_t, lseek, (int fd, off_t offset, int whence))
+{
+    count_syscall(SC_LSEEK);
+    return ORIGINAL(lseek)(fd, offset, whence);
+}
+
+OVERRIDE(int, fdatasync, (int fd))
+{
+    count_syscall(SC_FDATASYNC);
+    wait_for_storage();
+    return ORIGINAL(fdatasync)(fd);
+}
+
+OVERRIDE(int, fstat, (int fd, struct stat *statbuf))
+{
+    count_syscall(SC_FSTAT);
+    return ORIGINAL(fstat)(fd, statbuf);
+}
+
+OVERRIDE(int, fcntl, (int fd, int cmd, ...))
+{
+    count_syscall(SC_FCNTL);
+
+    // Heart only uses commands with an int argument or none
+    va_list ap;
+    va_start(ap, cmd);
+    int arg = va_arg(ap, int);
+    va_end(ap);
+
+    return ORIGINAL(fcntl)(fd, cmd, arg);
+}
+
+OVERRIDE(int, openat, (int dirfd, const char *pathname, int flags, ...))
+{
+    count_syscall(SC_OPENAT);
+    int mode;
+
+    va_list ap;
+    va_start(ap, flags);
+    if (flags & O_CREAT)
+        mode = va_arg(ap, int);
+    else
+        mode = 0;
+    va_end(ap);
+
+    return ORIGINAL(openat)(dirfd, pathname, flags, mode);
+}
+
+#ifdef __linux__
+// Heart only uses syscall() for getdents64
+OVERRIDE(long, syscall, (long number, ...))
+{
+    if (number == SYS_getdents64)
+        count_syscall(SC_GETDENTS);
+
+    va_list ap;
+    va_start(ap, number);
+    long a = va_arg(ap, long);
+    long b = va_arg(ap, long);
+    long c = va_arg(ap, long);
+    va_end(ap);
+
+    return ORIGINAL(syscall)(number, a, b, c);
+}
+#endif
+
 OVERRIDE(int, open, (const char *pathname, int flags, ...))
 {
+    count_syscall(SC_OPEN);
     int mode;
 
     va_list ap;
@@ -158,10 +855,31 @@ OVERRIDE(int, open, (const char *pathname, int flags, ...))
     if (strcmp(pathname, "/dev/kmsg") == 0 && (flags & (O_RDWR|O_WRONLY)))
         return dup(STDERR_FILENO);
 
+    // Keep /proc and /sys accesses hermetic
+    if (fake_root && (strncmp(pathname, "/proc/", 6) == 0 || strncmp(pathname, "/sys/", 5) == 0)) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", fake_root, pathname);
+        int fd = ORIGINAL(open)(path, flags, mode);
+
+        for (int i = 0; fd >= 0 && i < PSI_RESOURCES; i++) {
+            if (strncmp(pathname, "/proc/pressure/", 15) == 0 && strcmp(pathname + 15, psi_names[i]) == 0)
+                psi_fds[i] = fd;
+        }
+        return fd;
+    }
+
+    if (strcmp(pathname, "/dev/pmsg0") == 0) {
+        if (pmsg_path)
+            return ORIGINAL(open)(pmsg_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (report_pmsg)
+            return PMSG_FILENO;
+    }
+
     if (strncmp(pathname, "/dev/watchdog", 13) == 0) {
         if (open_tries <= 0) {
-            flog("open(%s) succeeded", pathname);
-            return WATCHDOG_FILENO;
+            int fd = wdt_open(pathname);
+            flog("open(%s) %s", pathname, fd >= 0 ? "succeeded" : "failed");
+            return fd;
         } else {
             flog("open(%s) failed", pathname);
             open_tries--;
@@ -174,7 +892,16 @@ OVERRIDE(int, open, (const char *pathname, int flags, ...))
 
 OVERRIDE(unsigned int, sleep, (unsigned int seconds))
 {
-    if (seconds >= 2) {
+    count_syscall(SC_SLEEP);
+    if (virtual_clock) {
+        int64_t wakeup = virtual_now + seconds * NS_PER_SEC;
+        run_sleepers_until(wakeup);
+        virtual_now = wakeup;
+        check_wdt_expiry(virtual_now);
+        if (seconds < 2)
+            flog("sleep(%u)", seconds);
+        return 0;
+    } else if (seconds >= 2) {
         // This is from the emulated sigtimedwait
         return ORIGINAL(sleep)(seconds);
     } else {
@@ -183,9 +910,80 @@ OVERRIDE(unsigned int, sleep, (unsigned int seconds))
     }
 }
 
+OVERRIDE(int, nanosleep, (const struct timespec *req, struct timespec *rem))
+{
+    count_syscall(SC_NANOSLEEP);
+    if (virtual_clock)
+        return virtual_nanosleep(req);
+    return ORIGINAL(nanosleep)(req, rem);
+}
+
+OVERRIDE(int, pthread_setschedparam, (pthread_t thread, int policy, const struct sched_param *param))
+{
+    count_syscall(SC_SCHED);
+    flog("pthread_setschedparam(%s, %d)", policy == SCHED_FIFO ? "SCHED_FIFO" : "UNEXPECTED!", param->sched_priority);
+    if (real_sched)
+        return ORIGINAL(pthread_setschedparam)(thread, policy, param);
+    return 0;
+}
+
+#ifndef __APPLE__
+OVERRIDE(int, pthread_setaffinity_np, (pthread_t thread, size_t cpusetsize, const cpu_set_t *cpuset))
+{
+    count_syscall(SC_SCHED);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, cpuset))
+            flog("pthread_setaffinity_np(%d)", cpu);
+    }
+    if (real_sched)
+        return ORIGINAL(pthread_setaffinity_np)(thread, cpusetsize, cpuset);
+    return 0;
+}
+#endif
+
+REPLACE(int, mlockall, (int flags))
+{
+    count_syscall(SC_MLOCKALL);
+    flog("mlockall(%s%s)",
+         (flags & MCL_CURRENT) ? "MCL_CURRENT" : "",
+         (flags & MCL_FUTURE) ? "|MCL_FUTURE" : "");
+    report_allocations = 1;
+    return 0;
+}
+
+#ifndef __APPLE__
+// Call glibc's allocator directly since dlsym allocates
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    if (report_allocations)
+        flog("malloc(%zu)", size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (report_allocations)
+        flog("calloc(%zu, %zu)", nmemb, size);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (report_allocations)
+        flog("realloc(%zu)", size);
+    return __libc_realloc(ptr, size);
+}
+#endif
+
 REPLACE(int, ioctl, (int fd, unsigned long request, ...))
 {
-    (void) fd;
+    count_syscall(SC_IOCTL);
+    // Only the countdown needs an open device
+    struct wdt_device *d = wdt_device(fd);
     va_list ap;
     va_start(ap, request);
 
@@ -221,25 +1019,39 @@ REPLACE(int, ioctl, (int fd, unsigned long request, ...))
     case WDIOC_SETOPTIONS:
         {
             int *v = va_arg(ap, int *);
-            *v = 0;
+            if (!d)
+                goto bad_fd;
+            if ((*v & WDIOS_DISABLECARD) && !wdt_nowayout)
+                d->running = 0;
+            if (*v & WDIOS_ENABLECARD)
+                wdt_pet(d);
             break;
         }
     case WDIOC_KEEPALIVE:
         {
-            int *v = va_arg(ap, int *);
-            *v = 0;
+            if (!d)
+                goto bad_fd;
+            check_wdt_expiry(monotonic_ns());
+            wdt_pet(d);
             break;
         }
     case WDIOC_SETTIMEOUT:
         {
             int *v = va_arg(ap, int *);
-            *v = 0;
+            if (!d)
+                goto bad_fd;
+            flog("settimeout(%d)", *v);
+            check_wdt_expiry(monotonic_ns());
+            d->timeout = *v;
+            wdt_pet(d);
             break;
         }
     case WDIOC_GETTIMEOUT:
         {
             int *v = va_arg(ap, int *);
-            *v = wdt_timeout;
+            if (!d)
+                goto bad_fd;
+            *v = d->timeout;
             break;
         }
     case WDIOC_SETPRETIMEOUT:
@@ -257,7 +1069,10 @@ REPLACE(int, ioctl, (int fd, unsigned long request, ...))
     case WDIOC_GETTIMELEFT:
         {
             int *v = va_arg(ap, int *);
-            *v = wdt_timeout / 2;
+            if (!d)
+                goto bad_fd;
+            int64_t left_ns = wdt_expiry_ns(d) - monotonic_ns();
+            *v = left_ns > 0 ? (left_ns * wdt_rate / 100) / NS_PER_SEC : 0;
             break;
         }
 
@@ -267,5 +1082,65 @@ REPLACE(int, ioctl, (int fd, unsigned long request, ...))
     }
     va_end(ap);
     return 0;
+
+bad_fd:
+    va_end(ap);
+    errno = EBADF;
+    return -1;
 }
 
+OVERRIDE(int, close, (int fd))
+{
+    count_syscall(SC_CLOSE);
+    struct wdt_device *d = wdt_device(fd);
+    if (d) {
+        wdt_close(d);
+        return 0;
+    }
+    return ORIGINAL(close)(fd);
+}
+
+OVERRIDE(int, execve, (const char *pathname, char *const argv[], char *const envp[]))
+{
+    count_syscall(SC_EXECVE);
+    flog("execve(%s)", pathname);
+
+    // Room for the longest possible numbers
+    char state[176 + WDT_DEVICES * 72];
+    size_t len = snprintf(state, sizeof(state), "HEART_FIXTURE_STATE=%d %" PRId64 " %" PRId64 " %lu %lu %d %d %d %d",
+                          to_elixir_fd, virtual_now, virtual_limit, advance_seq, acked_seq, stdout_stalled,
+                          wdt_rate, pet_delay_ms, exec_signal);
+    for (int i = 0; i < WDT_DEVICES && len < sizeof(state); i++) {
+        const struct wdt_device *d = &wdt_devices[i];
+        len += snprintf(state + len, sizeof(state) - len, " %d %d %d %d %" PRId64,
+                        d->open, d->running, d->expect_close, d->timeout, d->last_pet_ns);
+    }
+    if (len >= sizeof(state))
+        errx(EXIT_FAILURE, "fixture state doesn't fit in %zu bytes", sizeof(state));
+
+    char preload[PATH_MAX + 32];
+#ifdef __APPLE__
+    snprintf(preload, sizeof(preload), "DYLD_INSERT_LIBRARIES=%s", preload_path);
+#else
+    snprintf(preload, sizeof(preload), "LD_PRELOAD=%s", preload_path);
+#endif
+
+    // Pass the fixture and its state along with heart's environment
+    int count = 0;
+    while (envp[count])
+        count++;
+    char **env = malloc((count + 3) * sizeof(char *));
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (strncmp(envp[i], "HEART_FIXTURE_STATE=", 20) != 0)
+            env[n++] = envp[i];
+    }
+    env[n++] = state;
+    env[n++] = preload;
+    env[n] = NULL;
+
+    int rc = ORIGINAL(execve)(pathname, argv, env);
+    flog("execve(%s) failed", pathname);
+    free(env);
+    return rc;
+}
@@ -8,6 +8,13 @@ defmodule Heart do
 
   This lets tests send messages, get replies and check that the right
   syscalls were made to the OS.
+
+  Heart runs on a virtual clock by default. Time only passes when the test
+  calls `advance/2` so timeouts can be checked without waiting for them.
+  Pass `virtual_clock: false` to use the real clock.
+
+  Files that heart opens under `/proc` and `/sys` are redirected to the
+  `root` directory in `tmp_dir` so that tests can fake them.
   """
   use GenServer
 
@@ -32,9 +39,9 @@ defmodule Heart do
     GenServer.call(server, {:send_message, data})
   end
 
-  @spec request(GenServer.server(), iodata()) :: {:ok, any()}
-  def request(server, data) do
-    GenServer.call(server, {:request, data})
+  @spec request(GenServer.server(), iodata(), timeout()) :: {:ok, any()}
+  def request(server, data, timeout \\ 5000) do
+    GenServer.call(server, {:request, data}, timeout)
   end
 
   @spec pet(GenServer.server()) :: :ok
@@ -47,9 +54,9 @@ defmodule Heart do
     send_message(server, <<@shut_down>>)
   end
 
-  @spec set_cmd(GenServer.server(), String.t()) :: {:ok, :heart_ack}
-  def set_cmd(server, cmd) do
-    request(server, <<@set_cmd, cmd::binary>>)
+  @spec set_cmd(GenServer.server(), String.t(), timeout()) :: {:ok, :heart_ack}
+  def set_cmd(server, cmd, timeout \\ 5000) do
+    request(server, <<@set_cmd, cmd::binary>>, timeout)
   end
 
   @spec clear_cmd(GenServer.server()) :: {:ok, :heart_ack}
@@ -67,19 +74,93 @@ defmodule Heart do
     send_message(server, <<@preparing_crash>>)
   end
 
+  @doc """
+  Advance heart's virtual clock
+
+  This returns once heart has handled everything that happens in the time
+  interval and is idle again or has exited. All events caused by the time
+  passing will have been sent to the notification process by then.
+  """
+  @spec advance(GenServer.server(), non_neg_integer()) :: :ok
+  def advance(server, milliseconds) do
+    GenServer.call(server, {:advance, milliseconds})
+  end
+
+  @doc """
+  Return the smallest time in milliseconds that the watchdog had left when pet
+
+  Pets are still reported as `{:event, "pet(1)"}`. This returns `nil` if there
+  haven't been any pets.
+  """
+  @spec min_pet_margin(GenServer.server()) :: integer() | nil
+  def min_pet_margin(server) do
+    GenServer.call(server, :min_pet_margin)
+  end
+
+  @doc """
+  Return the calls that heart made since the last time this was called
+
+  The result maps call names like `"write"` or `"clock_gettime"` to counts.
+  Calls that weren't made aren't in the map. This only works with the virtual
+  clock since the fixture reports the counts when heart is idle.
+  """
+  @spec syscalls(GenServer.server()) :: %{String.t() => non_neg_integer()}
+  def syscalls(server) do
+    GenServer.call(server, :syscalls)
+  end
+
+  @doc """
+  Return heart's OS process ID for sending it signals
+  """
+  @spec os_pid(GenServer.server()) :: non_neg_integer()
+  def os_pid(server) do
+    GenServer.call(server, :os_pid)
+  end
+
+  @doc """
+  Send a control message to the test fixture
+
+  See heart_fixture.c for the messages that it supports.
+  """
+  @spec control(GenServer.server(), String.t()) :: :ok
+  def control(server, message) do
+    GenServer.call(server, {:control, message})
+  end
+
   @impl GenServer
   def init(init_args) do
     shim = Application.app_dir(:heart_test, ["priv", "heart_fixture.so"]) |> Path.expand()
     heart = Path.expand("../../heart")
     tmp_dir = init_args[:tmp_dir] || "/tmp"
     reports = Path.join(tmp_dir, "reports.sock")
+    control = Path.join(tmp_dir, "control.sock")
+    fake_root = Path.join(tmp_dir, "root")
     heart_beat_timeout = init_args[:heart_beat_timeout] || 60
     open_tries = init_args[:open_tries] || 0
     watchdog_path = init_args[:watchdog_path]
     wdt_timeout = init_args[:wdt_timeout] || 120
+    kernel_timeout = init_args[:kernel_timeout]
     crash_dump_seconds = init_args[:crash_dump_seconds]
     init_timeout = init_args[:init_timeout]
     init_grace_time = init_args[:init_grace_time]
+    virtual_clock = Keyword.get(init_args, :virtual_clock, true)
+    hardened = init_args[:hardened]
+    pet_thread_priority = init_args[:pet_thread_priority]
+    pet_thread_cpu = init_args[:pet_thread_cpu]
+    psi_threshold = init_args[:psi_threshold]
+    psi_duration = init_args[:psi_duration]
+    vm_pid = init_args[:vm_pid]
+    no_kill = init_args[:no_kill]
+    report_pmsg = init_args[:report_pmsg]
+    pmsg_format = init_args[:pmsg_format]
+    pmsg_path = init_args[:pmsg_path]
+    ledger_path = init_args[:ledger_path]
+    boot_times_path = init_args[:boot_times_path]
+    low_power = init_args[:low_power]
+    kexec = init_args[:kexec]
+    guarded_timeout = init_args[:guarded_timeout]
+    adaptive_pet = init_args[:adaptive_pet]
+    wdt_nowayout = init_args[:wdt_nowayout]
 
     File.exists?(shim) || raise "Can't find heart_fixture.so"
     File.exists?(heart) || raise "Can't find heart"
@@ -96,6 +177,9 @@ defmodule Heart do
         if wdt_timeout do
           {~c"WDT_TIMEOUT", ~c"#{wdt_timeout}"}
         end,
+        if kernel_timeout do
+          {~c"HEART_KERNEL_TIMEOUT", ~c"#{kernel_timeout}"}
+        end,
         if crash_dump_seconds do
           {~c"ERL_CRASH_DUMP_SECONDS", ~c"#{crash_dump_seconds}"}
         end,
@@ -108,9 +192,62 @@ defmodule Heart do
         if init_grace_time do
           {~c"HEART_INIT_GRACE_TIME", ~c"#{init_grace_time}"}
         end,
+        if virtual_clock do
+          {~c"HEART_VIRTUAL_CLOCK", ~c"1"}
+        end,
+        if hardened do
+          {~c"HEART_HARDENED", ~c"TRUE"}
+        end,
+        if pet_thread_priority do
+          {~c"HEART_PET_THREAD_PRIORITY", ~c"#{pet_thread_priority}"}
+        end,
+        if pet_thread_cpu do
+          {~c"HEART_PET_THREAD_CPU", ~c"#{pet_thread_cpu}"}
+        end,
+        if psi_threshold do
+          {~c"HEART_PSI_THRESHOLD", ~c"#{psi_threshold}"}
+        end,
+        if psi_duration do
+          {~c"HEART_PSI_DURATION", ~c"#{psi_duration}"}
+        end,
+        if no_kill do
+          {~c"HEART_NO_KILL", ~c"TRUE"}
+        end,
+        if report_pmsg do
+          {~c"HEART_REPORT_PMSG", ~c"1"}
+        end,
+        if pmsg_format do
+          {~c"HEART_PMSG_FORMAT", ~c"#{pmsg_format}"}
+        end,
+        if pmsg_path do
+          {~c"HEART_PMSG_PATH", to_charlist(pmsg_path)}
+        end,
+        if ledger_path do
+          {~c"HEART_LEDGER_PATH", to_charlist(ledger_path)}
+        end,
+        if boot_times_path do
+          {~c"HEART_BOOT_TIMES_PATH", to_charlist(boot_times_path)}
+        end,
+        if low_power do
+          {~c"HEART_LOW_POWER", ~c"TRUE"}
+        end,
+        if kexec do
+          {~c"HEART_KEXEC", ~c"TRUE"}
+        end,
+        if guarded_timeout do
+          {~c"HEART_GUARDED_TIMEOUT", ~c"#{guarded_timeout}"}
+        end,
+        if adaptive_pet do
+          {~c"HEART_ADAPTIVE_PET", ~c"TRUE"}
+        end,
+        if wdt_nowayout do
+          {~c"HEART_WDT_NOWAYOUT", ~c"1"}
+        end,
         {~c"LD_PRELOAD", c_shim},
         {~c"DYLD_INSERT_LIBRARIES", c_shim},
         {~c"HEART_REPORT_PATH", to_charlist(reports)},
+        {~c"HEART_CONTROL_PATH", to_charlist(control)},
+        {~c"HEART_FAKE_ROOT", to_charlist(fake_root)},
         {~c"HEART_WATCHDOG_OPEN_TRIES", to_charlist(open_tries)}
       ]
       |> Enum.filter(&Function.identity/1)
@@ -121,7 +258,7 @@ defmodule Heart do
       Port.open(
         {:spawn_executable, heart},
         [
-          {:args, ["-ht", "#{heart_beat_timeout}"]},
+          {:args, ["-ht", "#{heart_beat_timeout}"] ++ pid_args(vm_pid)},
           {:packet, 2},
           {:env, env},
           :exit_status
@@ -132,7 +269,12 @@ defmodule Heart do
      %{
        heart: heart_port,
        backend: backend_socket,
+       control: control,
        requests: :queue.new(),
+       advance_seq: 0,
+       advances: [],
+       min_pet_margin: nil,
+       syscall_waiters: [],
        notifications: init_args[:notifications]
      }}
   end
@@ -150,6 +292,41 @@ defmodule Heart do
     {:noreply, %{state | requests: :queue.in(from, state.requests)}}
   end
 
+  def handle_call(:min_pet_margin, _from, state) do
+    {:reply, state.min_pet_margin, state}
+  end
+
+  def handle_call(:syscalls, from, state) do
+    :ok = :gen_udp.send(state.backend, {:local, state.control}, 0, "syscalls")
+
+    {:noreply, %{state | syscall_waiters: state.syscall_waiters ++ [from]}}
+  end
+
+  def handle_call(:os_pid, _from, state) do
+    {:os_pid, os_pid} = Port.info(state.heart, :os_pid)
+    {:reply, os_pid, state}
+  end
+
+  def handle_call({:control, message}, _from, state) do
+    :ok = :gen_udp.send(state.backend, {:local, state.control}, 0, message)
+
+    {:reply, :ok, state}
+  end
+
+  def handle_call({:advance, milliseconds}, from, state) do
+    seq = state.advance_seq + 1
+
+    :ok =
+      :gen_udp.send(
+        state.backend,
+        {:local, state.control},
+        0,
+        "advance #{seq} #{milliseconds}"
+      )
+
+    {:noreply, %{state | advance_seq: seq, advances: [{seq, from} | state.advances]}}
+  end
+
   @impl GenServer
   def handle_info({heart, {:data, data}}, %{heart: heart} = state) do
     result = data |> IO.iodata_to_binary() |> decode_response()
@@ -165,16 +342,58 @@ defmodule Heart do
   end
 
   def handle_info({heart, {:exit_status, value}}, %{heart: heart} = state) do
-    case :queue.out(state.requests) do
-      {{:value, client}, new_requests} ->
-        GenServer.reply(client, {:error, :exit})
-        {:noreply, %{state | requests: new_requests}}
+    state =
+      case :queue.out(state.requests) do
+        {{:value, client}, new_requests} ->
+          GenServer.reply(client, {:error, :exit})
+          %{state | requests: new_requests}
+
+        {:empty, _requests} ->
+          process_event(state, {:exit, value})
+      end
+
+    # Time can't advance any more so let everyone waiting on it go
+    Enum.each(state.advances, fn {_seq, client} -> GenServer.reply(client, :ok) end)
+    {:noreply, %{state | advances: []}}
+  end
 
-      {:empty, _requests} ->
-        {:noreply, process_event(state, {:exit, value})}
+  def handle_info({:udp, backend, _, 0, "clock(" <> rest}, %{backend: backend} = state) do
+    {seq, ")"} = Integer.parse(rest)
+
+    {done, waiting} = Enum.split_with(state.advances, fn {s, _client} -> s <= seq end)
+    Enum.each(done, fn {_seq, client} -> GenServer.reply(client, :ok) end)
+
+    {:noreply, %{state | advances: waiting}}
+  end
+
+  def handle_info({:udp, backend, _, 0, "pet(" <> _ = data}, %{backend: backend} = state) do
+    # Keep the margin out of the event so that tests can match on "pet(1)"
+    case String.split(data, " margin=") do
+      [pet, margin] ->
+        margin = String.to_integer(margin)
+        min_pet_margin = if state.min_pet_margin, do: min(state.min_pet_margin, margin), else: margin
+        {:noreply, process_event(%{state | min_pet_margin: min_pet_margin}, {:event, pet})}
+
+      [pet] ->
+        {:noreply, process_event(state, {:event, pet})}
     end
   end
 
+  def handle_info({:udp, backend, _, 0, "syscalls(" <> rest}, %{backend: backend} = state) do
+    counts =
+      rest
+      |> String.trim_trailing(")")
+      |> String.split(" ", trim: true)
+      |> Map.new(fn pair ->
+        [name, count] = String.split(pair, "=")
+        {name, String.to_integer(count)}
+      end)
+
+    [client | waiting] = state.syscall_waiters
+    GenServer.reply(client, counts)
+    {:noreply, %{state | syscall_waiters: waiting}}
+  end
+
   def handle_info({:udp, backend, _, 0, data}, %{backend: backend} = state) do
     {:noreply, process_event(state, {:event, data})}
   end
@@ -202,6 +421,9 @@ defmodule Heart do
     {:heart_cmd, stats}
   end
 
+  defp pid_args(nil), do: []
+  defp pid_args(pid), do: ["-pid", "#{pid}"]
+
   defp open_backend_socket(socket_path) do
     # Blindly try to remove an old file just in case it exists from a previous run
     _ = File.rm(socket_path)
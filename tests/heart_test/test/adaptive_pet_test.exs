@@ -0,0 +1,86 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule AdaptivePetTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    pmsg_path = Path.join(context[:init_args][:tmp_dir], "pmsg")
+
+    [
+      init_args: context[:init_args] ++ [adaptive_pet: true, heart_beat_timeout: 4000, pmsg_path: pmsg_path],
+      pmsg_path: pmsg_path
+    ]
+  end
+
+  test "pets less often on a well-behaved watchdog", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    # 2 seconds of margin plus a second since pets are scheduled in whole seconds
+    assert cmd["wdt_pet_interval"] == "117"
+    assert cmd["wdt_pet_margin"] == "3"
+
+    Heart.advance(heart, 116_000)
+    refute_received {:event, "pet(1)"}
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "pet(1)"}
+  end
+
+  test "pets sooner when pets are slow", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.control(heart, "pet_delay 9000")
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+    assert Heart.min_pet_margin(heart) == 1000
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_pet_lateness_ms"] == "9000"
+    assert cmd["wdt_pet_interval"] == "108"
+    assert cmd["wdt_pet_margin"] == "12"
+  end
+
+  test "detects a watchdog that counts down too fast", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    # 8% fast means that the 120 second watchdog really expires at 111 seconds
+    Heart.control(heart, "wdt_rate 108")
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_drift_ppm"] == "72727"
+    assert cmd["wdt_pet_interval"] == "108"
+
+    assert File.read!(context.pmsg_path) =~ "WDT counts down 7.2% faster than its 120s timeout"
+  end
+
+  test "doesn't change the interval for small improvements", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    # Margin needs 9 seconds, so the interval could be 111, but that's within
+    # the 2 second hysteresis
+    Heart.control(heart, "pet_delay 6000")
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_pet_interval"] == "110"
+  end
+end
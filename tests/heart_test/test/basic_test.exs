@@ -44,22 +44,24 @@ defmodule BasicTest do
     assert_receive {:event, "open(/dev/watchdog0) succeeded"}
     assert_receive {:event, "pet(1)"}
 
-    refute_receive _, 6000
+    Heart.advance(heart, 6000)
+    refute_received _
 
     graceful_shutdown(heart)
   end
 
   test "heart reboots when not petted", context do
     # Shortest timeout is 11 seconds
-    start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
     assert_receive {:heart, :heart_ack}, 500
     assert_receive {:event, "open(/dev/watchdog0) succeeded"}
     assert_receive {:event, "pet(1)"}
 
-    Process.sleep(10000)
+    Heart.advance(heart, 10000)
     refute_received _
 
-    assert_receive {:event, "sync()"}, 1500
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "sync()"}
     assert_receive {:event, "reboot(0x01234567)"}
     assert_receive {:exit, 0}
   end
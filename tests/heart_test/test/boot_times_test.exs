@@ -0,0 +1,119 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule BootTimesTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    boot_times_path = Path.join(context[:init_args][:tmp_dir], "boot_times")
+
+    [
+      init_args: context[:init_args] ++ [boot_times_path: boot_times_path],
+      boot_times_path: boot_times_path
+    ]
+  end
+
+  # Wait for heart to handle the heartbeat before time moves on
+  defp heartbeat(heart) do
+    Heart.pet(heart)
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+  end
+
+  defp boot(context, heartbeat_ms, handshake_ms) do
+    heart = start_supervised!({Heart, context.init_args ++ [init_timeout: 60, init_grace_time: 20]})
+    assert_receive {:heart, :heart_ack}, 500
+
+    Heart.advance(heart, heartbeat_ms)
+    heartbeat(heart)
+    Heart.advance(heart, handshake_ms - heartbeat_ms)
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "init_handshake")
+
+    heart
+  end
+
+  defp restart(heart) do
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+  end
+
+  test "no history on first boot", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["boot_count"] == "0"
+    assert cmd["boot_first_heartbeat_ms"] == ""
+    assert cmd["boot_init_handshake_ms"] == ""
+    assert cmd["boot_grace_used_percent"] == ""
+  end
+
+  test "summarizes startup times across boots", context do
+    context |> boot(1500, 4000) |> restart()
+    context |> boot(800, 2000) |> restart()
+    heart = boot(context, 3000, 9000)
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["boot_count"] == "3"
+    assert cmd["boot_first_heartbeat_ms"] == "800,1500,3000"
+    assert cmd["boot_init_handshake_ms"] == "2000,4000,9000"
+    assert cmd["boot_grace_used_percent"] == "10,20,45"
+  end
+
+  test "only the first heartbeat counts without an init handshake", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    Heart.advance(heart, 500)
+    heartbeat(heart)
+    Heart.advance(heart, 1000)
+    heartbeat(heart)
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["boot_count"] == "1"
+    assert cmd["boot_first_heartbeat_ms"] == "500,500,500"
+    assert cmd["boot_init_handshake_ms"] == ""
+    assert cmd["boot_grace_used_percent"] == ""
+  end
+
+  test "boots that never get ready aren't recorded", context do
+    heart = start_supervised!({Heart, context.init_args ++ [init_timeout: 60]})
+    assert_receive {:heart, :heart_ack}, 500
+
+    heartbeat(heart)
+    restart(heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["boot_count"] == "0"
+  end
+
+  test "stuck storage doesn't hold up the first heartbeat or init handshake", context do
+    heart = start_supervised!({Heart, context.init_args ++ [init_timeout: 60, init_grace_time: 20]})
+    assert_receive {:heart, :heart_ack}, 500
+
+    Heart.control(heart, "stall_sync on")
+    Heart.advance(heart, 1000)
+    heartbeat(heart)
+    Heart.advance(heart, 1000)
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "init_handshake")
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+
+    # The write finishes before heart exits
+    Heart.control(heart, "stall_sync off")
+    restart(heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["boot_count"] == "1"
+    assert cmd["boot_init_handshake_ms"] == "2000,2000,2000"
+  end
+end
@@ -0,0 +1,67 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule FlightRecorderTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    pmsg_path = Path.join(context[:init_args][:tmp_dir], "pmsg")
+    [init_args: context[:init_args] ++ [pmsg_path: pmsg_path], pmsg_path: pmsg_path]
+  end
+
+  test "dumps recent events on a heartbeat timeout", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    for _ <- 1..2 do
+      Heart.advance(heart, 2000)
+      Heart.pet(heart)
+      assert_receive {:event, "pet(1)"}
+    end
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+
+    assert flight_recorder(context.pmsg_path) == [
+             "  -15000 ms pet latency=0us",
+             "  -13000 ms pet latency=0us",
+             "  -13000 ms heartbeat gap=2000ms",
+             "  -11000 ms pet latency=0us",
+             "  -11000 ms heartbeat gap=2000ms",
+             "  -5000 ms late heartbeat gap=6000ms"
+           ]
+  end
+
+  test "dumps recent events when the WDT is about to expire", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_hw")
+
+    # Flushed halfway between the usual pet time (110s) and expiry (120s)
+    Heart.advance(heart, 114_000)
+    refute File.read!(context.pmsg_path) =~ "flight recorder"
+
+    Heart.advance(heart, 1000)
+
+    assert flight_recorder(context.pmsg_path) == [
+             "  -115000 ms pet latency=0us",
+             "  -115000 ms set_cmd disable_hw"
+           ]
+
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+  end
+
+  defp flight_recorder(pmsg_path) do
+    [_, dump] = String.split(File.read!(pmsg_path), "nerves_heart flight recorder (newest last):\n")
+    String.split(dump, "\n", trim: true)
+  end
+end
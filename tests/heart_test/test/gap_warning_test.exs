@@ -0,0 +1,95 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule GapWarningTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "warns at half the heartbeat timeout before learning", context do
+    heart = start_supervised!({Heart, context.init_args ++ [report_pmsg: true]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 30_000)
+
+    assert_received {:event,
+                     "pmsg(heartbeat late: none for 30000 ms (warn at 30000 ms, timeout at 60 s))"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["heartbeat_late"] == "1"
+    assert cmd["heartbeat_late_count"] == "1"
+
+    # The warning doesn't pet the hardware watchdog or reboot
+    refute_received {:event, "pet(1)"}
+
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["heartbeat_late"] == "0"
+  end
+
+  test "learns normal heartbeat gaps", context do
+    heart = start_supervised!({Heart, context.init_args ++ [report_pmsg: true]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    for _ <- 1..100 do
+      Heart.advance(heart, 5000)
+      Heart.pet(heart)
+      assert_receive {:event, "pet(1)"}
+    end
+
+    # 5 seconds is in the 4096-5119 ms bucket
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["heartbeat_gap_p999"] == "5120"
+    assert cmd["heartbeat_late"] == "0"
+
+    Heart.advance(heart, 6000)
+
+    assert_received {:event,
+                     "pmsg(heartbeat late: none for 6000 ms (warn at 5120 ms, timeout at 60 s))"}
+
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+
+    # Breadcrumbs are rate limited, but late heartbeats are still counted
+    Heart.advance(heart, 7000)
+    refute_received {:event, "pmsg(heartbeat late" <> _}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["heartbeat_late"] == "1"
+    assert cmd["heartbeat_late_count"] == "2"
+  end
+
+  test "doesn't wake up to check for late heartbeats in the grace period", context do
+    heart = start_supervised!({Heart, context.init_args ++ [init_grace_time: 600]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+    _ = Heart.syscalls(heart)
+
+    Heart.advance(heart, 100_000)
+
+    assert Heart.syscalls(heart) == %{}
+  end
+
+  test "doesn't wake up to check for late heartbeats while snoozing", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "snooze")
+    assert_receive {:event, "pet(1)"}
+    _ = Heart.syscalls(heart)
+
+    Heart.advance(heart, 100_000)
+
+    assert Heart.syscalls(heart) == %{}
+  end
+end
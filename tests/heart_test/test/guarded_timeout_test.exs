@@ -0,0 +1,95 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule GuardedTimeoutTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    pmsg_path = Path.join(context[:init_args][:tmp_dir], "pmsg")
+
+    [
+      init_args: context[:init_args] ++ [guarded_timeout: 5, pmsg_path: pmsg_path],
+      pmsg_path: pmsg_path
+    ]
+  end
+
+  test "reboots directly when PID 1 doesn't", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_reboot")
+    assert_receive {:event, "kill(1, SIGTERM)"}
+    assert_receive {:event, "sync()"}
+
+    Heart.advance(heart, 4000)
+    refute_received {:event, "reboot" <> _}
+
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+
+    pmsg = File.read!(context.pmsg_path)
+    assert pmsg =~ "Guarded reboot not done after 5000 ms. Syncing and doing it directly."
+    assert pmsg =~ "Guarded reboot sync done after 0 ms"
+  end
+
+  test "powers off directly after Erlang exits", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_poweroff")
+    assert_receive {:event, "kill(1, SIGUSR2)"}
+    assert_receive {:event, "sync()"}
+
+    # Heart waits for PID 1 instead of exiting
+    Heart.shutdown(heart)
+    Heart.advance(heart, 4000)
+    refute_received {:exit, _}
+
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "reboot(0x4321fedc)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "halts directly", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_halt")
+    assert_receive {:event, "kill(1, SIGUSR1)"}
+
+    Heart.advance(heart, 5000)
+    assert_receive {:event, "reboot(0xcdef0123)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "doesn't get stuck on a sync that doesn't finish", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.control(heart, "stall_sync on")
+
+    # The sync gives up after 5 seconds of real time
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_reboot", 7000)
+    assert_receive {:event, "sync()"}
+
+    Heart.control(heart, "stall_sync off")
+    Heart.advance(heart, 5000)
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+
+    pmsg = File.read!(context.pmsg_path)
+    assert pmsg =~ "Guarded reboot sync timed out"
+    assert pmsg =~ "Guarded reboot sync done after 0 ms"
+  end
+end
@@ -0,0 +1,42 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule HardenedTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "hardened mode locks memory and never allocates", context do
+    oom_score_adj = Path.join(context.init_args[:tmp_dir], "root/proc/self/oom_score_adj")
+    File.mkdir_p!(Path.dirname(oom_score_adj))
+    File.write!(oom_score_adj, "")
+
+    heart = start_supervised!({Heart, context.init_args ++ [hardened: true, wdt_timeout: 10]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "mlockall(MCL_CURRENT|MCL_FUTURE)"}
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    assert File.read!(oom_score_adj) == "-1000"
+
+    # Exercise the main code paths. Any heap allocation gets reported as an
+    # event and fails the test.
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "init_handshake")
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "snooze")
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 5000)
+    assert_received {:event, "pet(1)"}
+
+    graceful_shutdown(heart)
+  end
+end
@@ -19,7 +19,7 @@ defmodule HeartTest do
     assert_receive {:heart, :heart_ack}, 500
     assert_receive {:event, "open(/dev/watchdog0) failed"}
 
-    Process.sleep(6000)
+    Heart.advance(heart, 6000)
 
     assert_receive {:event, "open(/dev/watchdog0) succeeded"}
     assert_receive {:event, "pet(1)"}
@@ -19,9 +19,11 @@ defmodule HwWdtTest do
     assert_receive {:event, "open(/dev/watchdog0) succeeded"}
     assert_receive {:event, "pet(1)"}
 
-    refute_receive _, 5500
+    Heart.advance(heart, 5500)
+    refute_received _
 
-    assert_receive {:event, "pet(1)"}, 1000
+    Heart.advance(heart, 500)
+    assert_received {:event, "pet(1)"}
 
     graceful_shutdown(heart)
   end
@@ -34,8 +36,8 @@ defmodule HwWdtTest do
     assert_receive {:event, "open(/dev/watchdog0) succeeded"}
     assert_receive {:event, "pet(1)"}
 
-    Process.sleep(5000)
-    assert_receive {:event, "pet(1)"}
+    Heart.advance(heart, 5000)
+    assert_received {:event, "pet(1)"}
 
     graceful_shutdown(heart)
   end
@@ -48,4 +50,51 @@ defmodule HwWdtTest do
 
     graceful_shutdown(heart)
   end
+
+  test "hw watchdog gets pet 10 seconds before it expires", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+    assert Heart.min_pet_margin(heart) == 10_000
+
+    graceful_shutdown(heart)
+  end
+
+  test "hw watchdog resets when not pet", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_hw")
+
+    Heart.advance(heart, 119_000)
+    refute_received {:event, "wdt_reset" <> _}
+
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "wdt_reset(/dev/watchdog0)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "hw watchdog keeps running when reopened after an error", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    Heart.control(heart, "pet_error 5")
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1) failed"}
+    assert_receive {:event, "close(/dev/watchdog0) not stopped"}
+
+    # Retried a second later and the countdown wasn't restarted by the open
+    Heart.advance(heart, 1000)
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+    assert Heart.min_pet_margin(heart) == 9000
+
+    graceful_shutdown(heart)
+  end
 end
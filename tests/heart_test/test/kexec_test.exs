@@ -0,0 +1,112 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule KexecTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    tmp_dir = context[:init_args][:tmp_dir]
+    kexec_loaded = Path.join(tmp_dir, "root/sys/kernel/kexec_loaded")
+    File.mkdir_p!(Path.dirname(kexec_loaded))
+    File.write!(kexec_loaded, "1\n")
+
+    pmsg_path = Path.join(tmp_dir, "pmsg")
+
+    [
+      init_args: context[:init_args] ++ [kexec: true, pmsg_path: pmsg_path],
+      kexec_loaded: kexec_loaded,
+      pmsg_path: pmsg_path
+    ]
+  end
+
+  test "heartbeat timeout reboots with kexec", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x45584543)"}
+    assert_receive {:exit, 0}
+
+    pmsg = File.read!(context.pmsg_path)
+    assert pmsg =~ "kexec kernel loaded. Recoveries will use kexec."
+    assert pmsg =~ "Rebooting with kexec"
+  end
+
+  test "crash reboots with kexec", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.preparing_crash(heart)
+    assert_receive {:event, "reboot(0x45584543)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "falls back to a normal restart when kexec fails", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    # Unloading the kernel makes the kexec reboot fail
+    File.write!(context.kexec_loaded, "0\n")
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "reboot(0x45584543)"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+
+    assert File.read!(context.pmsg_path) =~ "kexec failed: Invalid argument. Restarting normally."
+  end
+
+  test "restarts normally without a kexec kernel", context do
+    File.rm!(context.kexec_loaded)
+
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+    refute_received {:event, "reboot(0x45584543)"}
+
+    assert File.read!(context.pmsg_path) =~ "HEART_KEXEC is set, but no kexec kernel is loaded"
+  end
+
+  test "requested reboots don't use kexec", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_immediate_reboot")
+    assert_receive {:event, "reboot(0x01234567)"}
+  end
+
+  test "init handshake timeouts don't use kexec", context do
+    heart = start_supervised!({Heart, context.init_args ++ [init_timeout: 5]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 5000)
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+    refute_received {:event, "reboot(0x45584543)"}
+  end
+
+  test "disable_vm doesn't use kexec", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_vm")
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+    refute_received {:event, "reboot(0x45584543)"}
+  end
+end
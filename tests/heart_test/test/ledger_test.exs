@@ -0,0 +1,108 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule LedgerTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    ledger_path = Path.join(context[:init_args][:tmp_dir], "ledger")
+    [init_args: context[:init_args] ++ [ledger_path: ledger_path], ledger_path: ledger_path]
+  end
+
+  test "no history on first boot", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reboot_count"] == "0"
+    assert cmd["reboot_causes"] == ""
+  end
+
+  test "records reboot causes across restarts", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 11]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reboot_count"] == "1"
+    assert cmd["reboot_causes"] == "heartbeat_timeout"
+    assert cmd["reboot_heartbeat_ages"] == "11"
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_reboot")
+    assert_receive {:event, "kill(1, SIGTERM)"}
+
+    # Erlang exiting afterwards isn't recorded as another entry
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reboot_count"] == "2"
+    assert cmd["reboot_causes"] == "guarded_reboot,heartbeat_timeout"
+    assert cmd["reboot_heartbeat_ages"] == "0,11"
+    assert [_, _] = String.split(cmd["reboot_times"], ",")
+  end
+
+  test "ignores corrupt entries", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "guarded_reboot")
+    assert_receive {:event, "kill(1, SIGTERM)"}
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+
+    # Flip a bit in the second entry like a torn write would
+    <<first::binary-size(64), second::binary-size(64)>> = File.read!(context.ledger_path)
+    <<head::binary-size(20), byte, rest::binary>> = second
+    File.write!(context.ledger_path, [first, head, Bitwise.bxor(byte, 1), rest])
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reboot_count"] == "1"
+    assert cmd["reboot_causes"] == "guarded_reboot"
+  end
+
+  test "stuck storage doesn't hold up the main loop", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    Heart.control(heart, "stall_sync on")
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_hw")
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+
+    Heart.control(heart, "stall_sync off")
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+    stop_supervised!(Heart)
+
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reboot_causes"] == "disable_hw"
+  end
+end
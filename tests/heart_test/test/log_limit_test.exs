@@ -0,0 +1,36 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule LogLimitTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  @snooze_message "pmsg(Snoozing heart keepalive checks for 15 minutes)"
+
+  test "repeated messages are suppressed and summarized", context do
+    heart = start_supervised!({Heart, context.init_args ++ [report_pmsg: true]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    for _ <- 1..7, do: {:ok, :heart_ack} = Heart.set_cmd(heart, "snooze")
+
+    # Bursts of 5 are allowed
+    for _ <- 1..5, do: assert_receive({:event, @snooze_message})
+    refute_received {:event, @snooze_message}
+
+    # The summary comes with the next message after the interval
+    Heart.advance(heart, 10_000)
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "snooze")
+
+    assert_receive {:event,
+                    "pmsg(suppressed 2 repeats of 'Snoozing heart keepalive checks for 15 minutes')"}
+
+    assert_receive {:event, @snooze_message}
+  end
+end
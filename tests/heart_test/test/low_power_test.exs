@@ -0,0 +1,97 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule LowPowerTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "leaves the kernel watchdog timeout alone", context do
+    heart = start_supervised!({Heart, context.init_args ++ [low_power: true, wdt_timeout: 60]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+    refute_received {:event, "settimeout" <> _}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_timeout"] == "60"
+  end
+
+  test "kernel watchdog timeout can be raised separately", context do
+    heart =
+      start_supervised!(
+        {Heart, context.init_args ++ [low_power: true, wdt_timeout: 60, kernel_timeout: 120]}
+      )
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "settimeout(120)"}
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_timeout"] == "120"
+    assert cmd["wdt_pet_time_left"] == "110"
+  end
+
+  test "heartbeats only pet in the second half of the pet interval", context do
+    heart = start_supervised!({Heart, context.init_args ++ [low_power: true]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 10_000)
+    Heart.pet(heart)
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["wdt_pet_time_left"] == "100"
+    refute_received {:event, "pet(1)"}
+
+    # Half of the 110 second pet interval
+    Heart.advance(heart, 45_000)
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+  end
+
+  test "half the wakeups when heartbeats are slow", context do
+    # Heartbeats 40 seconds apart are late at 30 seconds, so normally there's a
+    # wakeup for the warning between each one
+    normal = run_for_two_hours(context.init_args, 40_000)
+    low_power = run_for_two_hours(context.init_args ++ [low_power: true], 40_000)
+
+    assert normal.wakeups_per_hour == 180
+    assert low_power.wakeups_per_hour == 90
+  end
+
+  test "a sixth of the pets when heartbeats are frequent", context do
+    normal = run_for_two_hours(context.init_args, 10_000)
+    low_power = run_for_two_hours(context.init_args ++ [low_power: true], 10_000)
+
+    # Every heartbeat pets normally, but only ones in the second half of the
+    # 110 second pet interval do in low power mode
+    assert normal.pets == 720
+    assert low_power.pets <= div(normal.pets, 6)
+    assert low_power.wakeups_per_hour <= normal.wakeups_per_hour
+  end
+
+  defp run_for_two_hours(init_args, heartbeat_interval) do
+    heart = start_supervised!({Heart, init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+    _ = Heart.syscalls(heart)
+
+    for _ <- 1..div(7_200_000, heartbeat_interval) do
+      Heart.advance(heart, heartbeat_interval)
+      Heart.pet(heart)
+    end
+
+    Heart.advance(heart, 0)
+
+    # Pets are the only writes since heartbeats aren't acknowledged
+    pets = Map.get(Heart.syscalls(heart), "write", 0)
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    stop_supervised!(Heart)
+
+    %{pets: pets, wakeups_per_hour: String.to_integer(cmd["wakeups_per_hour"])}
+  end
+end
@@ -0,0 +1,51 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule OutboundQueueTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "heart keeps petting when Erlang stops reading", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.control(heart, "stall_stdout on")
+
+    # More replies than fit in the queue
+    for _ <- 1..20, do: Heart.send_message(heart, <<6>>)
+
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+    refute_received {:heart, _}
+
+    Heart.control(heart, "stall_stdout off")
+    replies = receive_replies([])
+
+    assert length(replies) < 20
+
+    # The second reply was made while the first was still queued
+    assert hd(replies)["outbound_queue_bytes"] == "0"
+    assert String.to_integer(Enum.at(replies, 1)["outbound_queue_bytes"]) > 0
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["outbound_queue_bytes"] == "0"
+    assert String.to_integer(cmd["outbound_queue_drops"]) == 20 - length(replies)
+
+    graceful_shutdown(heart)
+  end
+
+  defp receive_replies(acc) do
+    receive do
+      {:heart, {:heart_cmd, cmd}} -> receive_replies([cmd | acc])
+    after
+      100 -> Enum.reverse(acc)
+    end
+  end
+end
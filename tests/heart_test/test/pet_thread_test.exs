@@ -0,0 +1,63 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule PetThreadTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  @pet_thread_args [wdt_timeout: 2, pet_thread_priority: 10]
+
+  test "pet thread pets the watchdog on its own", context do
+    heart =
+      start_supervised!({Heart, context.init_args ++ @pet_thread_args ++ [pet_thread_cpu: 0]})
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pthread_setschedparam(SCHED_FIFO, 10)"}
+    assert_receive {:event, "pthread_setaffinity_np(0)"}
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    # WDT timeout of 2 seconds means a pet every second
+    Heart.advance(heart, 1000)
+    assert_received {:event, "pet(1)"}
+    Heart.advance(heart, 1000)
+    assert_received {:event, "pet(1)"}
+    assert Heart.min_pet_margin(heart) == 1000
+
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+  end
+
+  test "watchdog that shows up late is opened without heartbeats", context do
+    heart = start_supervised!({Heart, context.init_args ++ @pet_thread_args ++ [open_tries: 1]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "open(/dev/watchdog0) failed"}
+
+    Heart.advance(heart, 6000)
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    Heart.shutdown(heart)
+    assert_receive {:exit, 0}
+  end
+
+  test "pet thread stops when the main loop says to", context do
+    heart = start_supervised!({Heart, context.init_args ++ @pet_thread_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pthread_setschedparam(SCHED_FIFO, 10)"}
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_hw")
+
+    Heart.advance(heart, 2000)
+    refute_received {:event, "pet(1)"}
+    assert_receive {:event, "wdt_reset(/dev/watchdog0)"}
+  end
+end
@@ -0,0 +1,72 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule PmsgBinaryTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "binary breadcrumbs decode to the text ones", context do
+    pmsg_path = Path.join(context.init_args[:tmp_dir], "pmsg")
+
+    heart =
+      start_supervised!(
+        {Heart,
+         context.init_args ++
+           [heart_beat_timeout: 11, pmsg_format: "binary", pmsg_path: pmsg_path]}
+      )
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 11_000)
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+
+    # Other programs write text to pmsg too
+    File.write!(pmsg_path, "erlinit: some other message\n", [:append])
+
+    # About 10x smaller than the text breadcrumbs. The flight recorder is always text.
+    contents = File.read!(pmsg_path)
+    {flight_recorder_start, _} = :binary.match(contents, " nerves_heart flight recorder")
+    assert flight_recorder_start - byte_size("2026-01-01T00:00:00.000000+00:00") < 100
+
+    decoder = Path.expand("../../tools/pmsg_decode")
+    {output, 0} = System.cmd(decoder, [Path.expand("../../heart"), pmsg_path])
+    [first | _] = lines = String.split(output, "\n", trim: true)
+
+    assert Enum.map(lines, &strip_timestamp/1) == [
+             "nerves_heart nerves_heart 2.5.0",
+             "nerves_heart kernel watchdog activated. WDT timeout 120s, WDT pet interval 110s, VM timeout 11s, initial grace period 0s",
+             "nerves_heart heartbeat late: none for 6000 ms (warn at 5500 ms, timeout at 11 s)",
+             "nerves_heart heartbeat timeout -> no activity for 11 seconds",
+             "nerves_heart flight recorder (newest last):",
+             "  -11000 ms pet latency=0us",
+             "  -5000 ms late heartbeat gap=6000ms",
+             "erlinit: some other message"
+           ]
+
+    # Timestamps are deltas on the monotonic clock
+    last = Enum.at(lines, 3)
+    assert DateTime.diff(timestamp(last), timestamp(first), :millisecond) == 11_000
+  end
+
+  defp strip_timestamp(line) do
+    case String.split(line, " ", parts: 2) do
+      [<<_::binary-size(4), "-", _::binary>>, rest] -> rest
+      _ -> line
+    end
+  end
+
+  defp timestamp(line) do
+    [timestamp | _] = String.split(line, " ")
+    {:ok, datetime, _} = DateTime.from_iso8601(timestamp)
+    datetime
+  end
+end
@@ -0,0 +1,98 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule PsiTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    context = common_setup()
+    pressure = Path.join(context[:init_args][:tmp_dir], "root/proc/pressure")
+    File.mkdir_p!(pressure)
+
+    File.write!(Path.join(pressure, "cpu"), """
+    some avg10=12.50 avg60=10.00 avg300=5.00 total=1000
+    """)
+
+    for resource <- ["memory", "io"] do
+      File.write!(Path.join(pressure, resource), """
+      some avg10=3.25 avg60=1.00 avg300=0.50 total=500
+      full avg10=1.75 avg60=0.50 avg300=0.25 total=200
+      """)
+    end
+
+    context
+  end
+
+  test "reports pressure stall information", context do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+
+    assert cmd["psi_cpu_some"] == "12.50"
+    assert cmd["psi_memory_some"] == "3.25"
+    assert cmd["psi_memory_full"] == "1.75"
+    assert cmd["psi_io_some"] == "3.25"
+    assert cmd["psi_io_full"] == "1.75"
+    refute Map.has_key?(cmd, "psi_stall_time")
+
+    graceful_shutdown(heart)
+  end
+
+  test "reboots on sustained memory stall", context do
+    heart =
+      start_supervised!({Heart, context.init_args ++ [psi_threshold: 40, psi_duration: 60]})
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "psi_trigger(memory, full 4000000 10000000)"}
+    assert_receive {:event, "psi_trigger(io, full 4000000 10000000)"}
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    # The stall keeps the PSI trigger firing every window even though
+    # heartbeats still arrive
+    for _ <- 1..6 do
+      Heart.control(heart, "psi memory")
+      Heart.advance(heart, 10_000)
+      Heart.pet(heart)
+      assert_receive {:event, "pet(1)"}
+    end
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["psi_stall_time"] == "60"
+
+    Heart.control(heart, "psi memory")
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "stall ends when the trigger stops firing", context do
+    heart =
+      start_supervised!({Heart, context.init_args ++ [psi_threshold: 40, psi_duration: 60]})
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "psi_trigger(memory, full 4000000 10000000)"}
+    assert_receive {:event, "psi_trigger(io, full 4000000 10000000)"}
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    # Triggers 25 seconds apart are separate stalls
+    for _ <- 1..4 do
+      Heart.control(heart, "psi io")
+      Heart.advance(heart, 25_000)
+      Heart.pet(heart)
+      assert_receive {:event, "pet(1)"}
+    end
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["psi_stall_time"] == "0"
+
+    graceful_shutdown(heart)
+  end
+end
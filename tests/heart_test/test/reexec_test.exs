@@ -0,0 +1,113 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule ReexecTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  setup do
+    common_setup()
+  end
+
+  test "reexec keeps the heartbeat timeout", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 30]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    Heart.advance(heart, 20_000)
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "reexec")
+    assert_receive {:event, "execve(" <> _}
+    assert_receive {:event, "pet(1)"}
+
+    # The new image uses the watchdog that's already open
+    refute_received {:event, "open(/dev/watchdog0) succeeded"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reexec_count"] == "1"
+    assert cmd["reexec_handoff_ms"] == "0"
+    assert cmd["heartbeat_time_left"] == "10"
+
+    Heart.advance(heart, 10_000)
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "ack comes after replies that Erlang hadn't read", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    Heart.control(heart, "stall_stdout on")
+
+    # GET_CMD and then SET_CMD "reexec"
+    Heart.send_message(heart, <<6>>)
+    Heart.send_message(heart, <<4, "reexec">>)
+    assert_receive {:event, "execve(" <> _}
+    assert_receive {:event, "pet(1)"}
+    refute_received {:heart, _}
+
+    Heart.control(heart, "stall_stdout off")
+    assert_receive {:heart, {:heart_cmd, cmd}}
+    assert cmd["program_name"] == "nerves_heart"
+    assert_receive {:heart, :heart_ack}
+
+    graceful_shutdown(heart)
+  end
+
+  test "reexec on SIGUSR2", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 30]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {_, 0} = System.cmd("kill", ["-USR2", "#{Heart.os_pid(heart)}"])
+    assert_receive {:event, "execve(" <> _}
+    assert_receive {:event, "pet(1)"}
+
+    # Erlang didn't ask, so there's no ack
+    refute_receive {:heart, :heart_ack}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reexec_count"] == "1"
+
+    graceful_shutdown(heart)
+  end
+
+  test "signals during the exec wait for the new image", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 30]})
+    assert_receive {:heart, :heart_ack}, 500
+
+    Heart.control(heart, "signal_after_exec SIGUSR1")
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "reexec")
+    assert_receive {:event, "raise(SIGUSR1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["snooze_time_left"] == "900"
+
+    Heart.control(heart, "signal_after_exec SIGUSR2")
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "reexec")
+    assert_receive {:event, "raise(SIGUSR2)"}
+
+    # The new image re-execs again for the signal before reading from Erlang
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+    assert cmd["reexec_count"] == "3"
+
+    graceful_shutdown(heart)
+  end
+
+  test "watchdog stays disabled across reexec", context do
+    heart = start_supervised!({Heart, context.init_args ++ [heart_beat_timeout: 300]})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "disable_hw")
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "reexec")
+    assert_receive {:event, "execve(" <> _}
+
+    Heart.advance(heart, 120_000)
+    refute_received {:event, "pet(1)"}
+    assert_receive {:event, "wdt_reset(/dev/watchdog0)"}
+  end
+end
@@ -24,16 +24,13 @@ defmodule SnoozeTest do
     # Check for immediate petting of the watchdog
     assert_receive {:event, "pet(1)"}
 
-    # Check that the watchdog is pet automatically
-    assert_receive {:event, "pet(1)"}, 2500
-    assert_receive {:event, "pet(1)"}, 2500
-    assert_receive {:event, "pet(1)"}, 2500
-    assert_receive {:event, "pet(1)"}, 2500
-    assert_receive {:event, "pet(1)"}, 2500
-
-    # This will get us past the Erlang heart beat timeout of 11 seconds
-    assert_receive {:event, "pet(1)"}, 2500
-
-    refute_receive {:exit, 0}, 100
+    # Check that the watchdog is pet automatically. 12 seconds gets us past the
+    # Erlang heart beat timeout of 11 seconds.
+    for _ <- 1..12 do
+      Heart.advance(heart, 1000)
+      assert_received {:event, "pet(1)"}
+    end
+
+    refute_received {:exit, 0}
   end
 end
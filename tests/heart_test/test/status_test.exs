@@ -20,6 +20,12 @@ defmodule StatusTest do
     {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
 
     assert cmd == %{
+             "heartbeat_gap_p999" => "0",
+             "heartbeat_late" => "0",
+             "heartbeat_late_count" => "0",
+             "outbound_queue_bytes" => "0",
+             "outbound_queue_drops" => "0",
+             "wakeups_per_hour" => "1",
              "heartbeat_time_left" => "60",
              "heartbeat_timeout" => "60",
              "init_handshake_happened" => "1",
@@ -28,14 +34,20 @@ defmodule StatusTest do
              "init_grace_time_left" => "0",
              "program_name" => "nerves_heart",
              "program_version" => "2.5.0",
+             "reexec_count" => "0",
+             "reexec_handoff_ms" => "0",
              "snooze_time_left" => "0",
              "wdt_firmware_version" => "0",
              "wdt_identity" => "OMAP Watchdog",
              "wdt_last_boot" => "power_on",
              "wdt_options" => "settimeout,magicclose,keepaliveping,",
+             "wdt_drift_ppm" => "0",
+             "wdt_pet_interval" => "110",
+             "wdt_pet_lateness_ms" => "0",
+             "wdt_pet_margin" => "10",
              "wdt_pet_time_left" => "110",
              "wdt_pre_timeout" => "0",
-             "wdt_time_left" => "60",
+             "wdt_time_left" => "120",
              "wdt_timeout" => "120"
            }
 
@@ -0,0 +1,86 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule SyscallBudgetTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  # Calls that heart may make to handle one of each. Heart runs on every
+  # device all the time, so these should only go up on purpose. Lower them
+  # when heart gets cheaper.
+  @heartbeat %{"clock_gettime" => 3, "read" => 2, "select" => 1, "write" => 1}
+  @idle_pet %{"clock_gettime" => 3, "select" => 1, "write" => 1}
+  @get_cmd %{"clock_gettime" => 1, "ioctl" => 4, "read" => 2, "select" => 1, "write" => 1}
+  @set_cmd %{"clock_gettime" => 2, "read" => 2, "select" => 1, "write" => 1}
+
+  setup do
+    context = common_setup()
+    [init_args: context[:init_args] ++ [heart_beat_timeout: 300]]
+  end
+
+  defp start_heart(context) do
+    heart = start_supervised!({Heart, context.init_args})
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    # Start counting from here
+    _ = Heart.syscalls(heart)
+    heart
+  end
+
+  defp assert_within_budget(counts, budget, times \\ 1) do
+    for {name, count} <- counts do
+      allowed = Map.get(budget, name, 0) * times
+
+      assert count <= allowed,
+             "#{count} #{name} calls is over the budget of #{allowed} (all calls: #{inspect(counts)})"
+    end
+  end
+
+  test "heartbeats", context do
+    heart = start_heart(context)
+
+    for _ <- 1..10 do
+      Heart.pet(heart)
+      assert_receive {:event, "pet(1)"}
+    end
+
+    assert_within_budget(Heart.syscalls(heart), @heartbeat, 10)
+  end
+
+  test "petting the watchdog while idle", context do
+    heart = start_heart(context)
+
+    Heart.advance(heart, 110_000)
+    assert_receive {:event, "pet(1)"}
+
+    assert_within_budget(Heart.syscalls(heart), @idle_pet)
+  end
+
+  test "idle time between pets is free", context do
+    heart = start_heart(context)
+
+    Heart.advance(heart, 100_000)
+    refute_received {:event, "pet(1)"}
+
+    assert Heart.syscalls(heart) == %{}
+  end
+
+  test "getting the status", context do
+    heart = start_heart(context)
+
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+
+    assert_within_budget(Heart.syscalls(heart), @get_cmd)
+  end
+
+  test "setting a command", context do
+    heart = start_heart(context)
+
+    {:ok, :heart_ack} = Heart.set_cmd(heart, "init_handshake")
+
+    assert_within_budget(Heart.syscalls(heart), @set_cmd)
+  end
+end
@@ -11,8 +11,9 @@ defmodule HeartTestCommon do
   use ExUnit.Case
 
   def common_setup() do
-    # We need short temporary directory paths, so create them ourselves.
-    path = "/tmp/heart_test/#{:rand.uniform(1_000_000)}"
+    # We need short temporary directory paths, so create them ourselves. They
+    # must be unique since the socket paths are in them and tests run async.
+    path = "/tmp/heart_test/#{System.pid()}-#{System.unique_integer([:positive])}"
     File.mkdir_p!(path)
     on_exit(fn -> File.rm_rf!(path) end)
 
@@ -0,0 +1,147 @@
+# SPDX-FileCopyrightText: 2026 Frank Hunleth
+#
+# SPDX-License-Identifier: Apache-2.0
+
+defmodule VmMonitorTest do
+  use ExUnit.Case, async: true
+
+  import HeartTestCommon
+
+  @pid 1234
+
+  setup do
+    context = common_setup()
+    proc = Path.join(context[:init_args][:tmp_dir], "root/proc/#{@pid}")
+    File.mkdir_p!(Path.join(proc, "task/#{@pid}"))
+    File.mkdir_p!(Path.join(proc, "task/#{@pid + 1}"))
+
+    write_proc(proc, utime: 200, stime: 100, majflt: 5, rss: 51200, run_delay: 2_000_000_000)
+    Keyword.put(context, :proc, proc)
+  end
+
+  test "reports VM resource usage", context do
+    heart =
+      start_supervised!({Heart, context.init_args ++ [vm_pid: @pid, heart_beat_timeout: 30]})
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "open(/dev/watchdog0) succeeded"}
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+
+    assert %{
+             "vm_cpu" => "0",
+             "vm_rss" => "51200",
+             "vm_rss_growth" => "0",
+             "vm_swap" => "0",
+             "vm_major_faults" => "0",
+             "vm_threads" => "3",
+             "vm_run_delay" => "0"
+           } = cmd
+
+    # Over 20 seconds, use 7 seconds of CPU, have 100 major faults, grow by
+    # 1000 kB and wait 2 seconds to run.
+    write_proc(context.proc,
+      utime: 700,
+      stime: 300,
+      majflt: 105,
+      rss: 52200,
+      run_delay: 4_000_000_000
+    )
+
+    Heart.advance(heart, 20_000)
+    Heart.pet(heart)
+    assert_receive {:event, "pet(1)"}
+
+    {:ok, {:heart_cmd, cmd}} = Heart.get_cmd(heart)
+
+    assert %{
+             "vm_cpu" => "35",
+             "vm_rss" => "52200",
+             "vm_rss_growth" => "1000",
+             "vm_major_faults" => "5",
+             "vm_run_delay" => "10"
+           } = cmd
+
+    graceful_shutdown(heart)
+  end
+
+  test "logs VM resource usage before rebooting", context do
+    heart =
+      start_supervised!(
+        {Heart,
+         context.init_args ++
+           [vm_pid: @pid, heart_beat_timeout: 11, no_kill: true, report_pmsg: true]}
+      )
+
+    assert_receive {:heart, :heart_ack}, 500
+    assert_receive {:event, "pet(1)"}
+
+    # Spin on one CPU while waiting to run on another
+    write_proc(context.proc,
+      utime: 1300,
+      stime: 100,
+      majflt: 5,
+      rss: 51200,
+      run_delay: 13_000_000_000
+    )
+
+    Heart.advance(heart, 11_000)
+
+    assert_receive {:event, "pmsg(heartbeat timeout -> no activity for 11 seconds)"}
+
+    expected =
+      "pmsg(vm: cpu 100%, rss 51200kB (+0kB/h), swap 0kB, major faults 0/s, threads 3, " <>
+        "run delay 100%)"
+
+    assert_receive {:event, ^expected}
+
+    assert_receive {:event, "sync()"}
+    assert_receive {:event, "reboot(0x01234567)"}
+    assert_receive {:exit, 0}
+  end
+
+  test "keeps thread schedstat files open between samples", context do
+    heart =
+      start_supervised!({Heart, context.init_args ++ [vm_pid: @pid, heart_beat_timeout: 30]})
+
+    assert_receive {:heart, :heart_ack}, 500
+
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+    _ = Heart.syscalls(heart)
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+    refute Map.has_key?(Heart.syscalls(heart), "openat")
+
+    # One thread exits and another starts
+    File.rm_rf!(Path.join(context.proc, "task/#{@pid + 1}"))
+    File.mkdir_p!(Path.join(context.proc, "task/#{@pid + 2}"))
+    File.write!(Path.join(context.proc, "task/#{@pid + 2}/schedstat"), "100 1000000000 50\n")
+
+    {:ok, {:heart_cmd, _cmd}} = Heart.get_cmd(heart)
+    assert %{"openat" => 1, "close" => 1} = Heart.syscalls(heart)
+
+    graceful_shutdown(heart)
+  end
+
+  defp write_proc(proc, values) do
+    File.write!(
+      Path.join(proc, "stat"),
+      "#{@pid} (beam.smp) S 1 #{@pid} #{@pid} 0 -1 4194560 1000 0 #{values[:majflt]} 0 " <>
+        "#{values[:utime]} #{values[:stime]} 0 0 20 0 3 0 100 2000000000 12800\n"
+    )
+
+    File.write!(Path.join(proc, "status"), """
+    Name:\tbeam.smp
+    State:\tS (sleeping)
+    Pid:\t#{@pid}
+    VmRSS:\t   #{values[:rss]} kB
+    VmSwap:\t       0 kB
+    Threads:\t3
+    """)
+
+    # Split the run delay between two threads
+    half = div(values[:run_delay], 2)
+    File.write!(Path.join(proc, "task/#{@pid}/schedstat"), "100 #{half} 50\n")
+    File.write!(Path.join(proc, "task/#{@pid + 1}/schedstat"), "100 #{half} 50\n")
+  end
+end
@@ -0,0 +1,446 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// Pet jitter harness
+//
+// This runs heart with heart_fixture.so's simulated watchdog while loading
+// the host in different ways. The fixture reports the margin with each pet.
+// That's how much time the watchdog had left when the pet arrived:
+//
+//     margin = previous pet + WDT timeout - this pet
+//
+// If the watchdog expires, the fixture reports a reset and heart exits, so
+// that run counts one missed pet and ends early.
+//
+// Heart isn't sent heartbeats and the heartbeat timeout is set to the max, so
+// all pets are timer-driven. The reported margins show how much of heart's pet
+// buffer gets used up by scheduling delays.
+//
+// The fixture stubs out reboot() and friends, so this is safe to run on a
+// development machine. The load profiles are real, though, so don't run this
+// on a machine that you're using for something else.
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_LOAD_PROCS 256
+#define IO_BLOCK_SIZE  (1024 * 1024)
+#define IO_FILE_SIZE   (64 * 1024 * 1024)
+#define FIFO_PRIORITY  50
+
+struct load_profile {
+    const char *name;
+    void (*run)(int index);
+};
+
+struct sched_config {
+    const char *name;
+    int heart_fifo;     // Run all of heart at SCHED_FIFO
+    int pet_thread;     // Use heart's SCHED_FIFO pet thread
+};
+
+static const char *heart_path;
+static const char *fixture_path;
+static int duration = 60;
+static int wdt_timeout = 2;
+static long memory_mb = 0;
+static int nprocs = 1;
+
+static pid_t load_pids[MAX_LOAD_PROCS];
+static int load_count = 0;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Heart's fixed pet interval. Runs unset HEART_ADAPTIVE_PET so that heart
+// uses this rule and doesn't adjust the interval to the measured lateness.
+static int pet_interval(int timeout)
+{
+    return timeout > 20 ? timeout - 10 : timeout / 2;
+}
+
+static void cpu_load(int index)
+{
+    (void) index;
+    volatile unsigned long x = 0;
+    for (;;)
+        x++;
+}
+
+static void memory_load(int index)
+{
+    (void) index;
+    size_t len = (size_t) memory_mb * 1024 * 1024 / nprocs;
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    // Keep touching more memory than fits to force reclaim
+    for (;;) {
+        char *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            _exit(EXIT_FAILURE);
+        for (size_t i = 0; i < len; i += page_size)
+            p[i] = 1;
+        munmap(p, len);
+    }
+}
+
+static void io_load(int index)
+{
+    (void) index;
+    const char *tmpdir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/pet_jitter.XXXXXX", tmpdir ? tmpdir : "/tmp");
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+        _exit(EXIT_FAILURE);
+    unlink(path);
+
+    static char block[IO_BLOCK_SIZE];
+    memset(block, 0x55, sizeof(block));
+
+    off_t offset = 0;
+    for (;;) {
+        if (pwrite(fd, block, sizeof(block), offset) < 0)
+            _exit(EXIT_FAILURE);
+        fdatasync(fd);
+        offset += sizeof(block);
+        if (offset >= IO_FILE_SIZE) {
+            ftruncate(fd, 0);
+            offset = 0;
+        }
+    }
+}
+
+// User space can't raise hardware interrupts, so approximate a flood with
+// loopback network traffic (softirqs) and fast high resolution timers.
+static void irq_load(int index)
+{
+    if (index % 2 == 0) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 ||
+            bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            getsockname(fd, (struct sockaddr *) &addr, &addr_len) < 0)
+            _exit(EXIT_FAILURE);
+
+        char packet[64] = {0};
+        for (;;) {
+            sendto(fd, packet, sizeof(packet), 0, (struct sockaddr *) &addr, addr_len);
+            recv(fd, packet, sizeof(packet), MSG_DONTWAIT);
+        }
+    } else {
+        int fd = timerfd_create(CLOCK_MONOTONIC, 0);
+        struct itimerspec its = {
+            .it_interval = { .tv_sec = 0, .tv_nsec = 20000 },
+            .it_value = { .tv_sec = 0, .tv_nsec = 20000 }
+        };
+        if (fd < 0 || timerfd_settime(fd, 0, &its, NULL) < 0)
+            _exit(EXIT_FAILURE);
+
+        unsigned long long expirations;
+        for (;;) {
+            if (read(fd, &expirations, sizeof(expirations)) < 0)
+                _exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static const struct load_profile profiles[] = {
+    { "idle", NULL },
+    { "cpu", cpu_load },
+    { "memory", memory_load },
+    { "io", io_load },
+    { "irq", irq_load },
+    { NULL, NULL }
+};
+
+static const struct sched_config configs[] = {
+    { "default", 0, 0 },
+    { "heart_fifo", 1, 0 },
+    { "pet_thread", 0, 1 },
+    { NULL, 0, 0 }
+};
+
+static void start_load(const struct load_profile *profile)
+{
+    if (!profile->run)
+        return;
+
+    for (int i = 0; i < nprocs && load_count < MAX_LOAD_PROCS; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            err(EXIT_FAILURE, "fork");
+        if (pid == 0) {
+            profile->run(i);
+            _exit(EXIT_SUCCESS);
+        }
+        load_pids[load_count++] = pid;
+    }
+
+    // Let the load get going
+    sleep(1);
+}
+
+static void stop_load(void)
+{
+    for (int i = 0; i < load_count; i++)
+        kill(load_pids[i], SIGKILL);
+    for (int i = 0; i < load_count; i++)
+        waitpid(load_pids[i], NULL, 0);
+    load_count = 0;
+}
+
+static pid_t start_heart(const struct sched_config *config, const char *report_path, int *to_heart, int *from_heart)
+{
+    int in[2];
+    int out[2];
+    if (pipe(in) < 0 || pipe(out) < 0)
+        err(EXIT_FAILURE, "pipe");
+
+    pid_t pid = fork();
+    if (pid < 0)
+        err(EXIT_FAILURE, "fork");
+
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+
+        char timeout_str[16];
+        snprintf(timeout_str, sizeof(timeout_str), "%d", wdt_timeout);
+
+        setenv("LD_PRELOAD", fixture_path, 1);
+        setenv("HEART_REPORT_PATH", report_path, 1);
+        setenv("HEART_REAL_SCHED", "1", 1);
+        setenv("WDT_TIMEOUT", timeout_str, 1);
+        setenv("HEART_VERBOSE", "0", 1);
+        setenv("HEART_NO_KILL", "TRUE", 1);
+        unsetenv("HEART_ADAPTIVE_PET");
+
+        if (config->pet_thread) {
+            char priority[16];
+            snprintf(priority, sizeof(priority), "%d", FIFO_PRIORITY);
+            setenv("HEART_PET_THREAD_PRIORITY", priority, 1);
+        }
+        if (config->heart_fifo) {
+            struct sched_param param = { .sched_priority = FIFO_PRIORITY };
+            if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+                _exit(3);
+        }
+
+        execl(heart_path, heart_path, "-ht", "65535", (char *) NULL);
+        _exit(127);
+    }
+
+    close(in[0]);
+    close(out[1]);
+    *to_heart = in[1];
+    *from_heart = out[0];
+    return pid;
+}
+
+static int compare_longs(const void *a, const void *b)
+{
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(const long *sorted, int count, double p)
+{
+    int i = (int) (p / 100.0 * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void run(const struct sched_config *config, const struct load_profile *profile, const char *report_path)
+{
+    int report_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (report_fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, report_path, sizeof(addr.sun_path) - 1);
+    unlink(report_path);
+    if (bind(report_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        err(EXIT_FAILURE, "bind %s", report_path);
+
+    start_load(profile);
+
+    int to_heart;
+    int from_heart;
+    pid_t heart_pid = start_heart(config, report_path, &to_heart, &from_heart);
+
+    int max_samples = duration * 2 / pet_interval(wdt_timeout) + 16;
+    long *margins = calloc(max_samples, sizeof(long));
+    int count = 0;
+    int missed = 0;
+    int pets = 0;
+    long long end_time = now_ns() + duration * 1000000000LL;
+
+    for (long long now = now_ns(); now < end_time; now = now_ns()) {
+        struct pollfd pfd = { .fd = report_fd, .events = POLLIN };
+        if (poll(&pfd, 1, (int) ((end_time - now) / 1000000) + 1) <= 0)
+            continue;
+
+        char buffer[256];
+        ssize_t len = recv(report_fd, buffer, sizeof(buffer) - 1, 0);
+        if (len <= 0)
+            continue;
+        buffer[len] = '\0';
+
+        if (strncmp(buffer, "wdt_reset", 9) == 0) {
+            missed++;
+            break;
+        }
+
+        // Skip the pet right after opening since nothing was counting down yet
+        long margin;
+        if (sscanf(buffer, "pet(1) margin=%ld", &margin) == 1 && pets++ > 0 && count < max_samples)
+            margins[count++] = margin;
+    }
+
+    // Ask heart to exit without rebooting
+    unsigned char shut_down[3] = { 0, 1, 3 };
+    if (write(to_heart, shut_down, sizeof(shut_down)) < 0)
+        kill(heart_pid, SIGKILL);
+
+    int status;
+    waitpid(heart_pid, &status, 0);
+    close(to_heart);
+    close(from_heart);
+    close(report_fd);
+    unlink(report_path);
+    stop_load();
+
+    printf("%-12s %-8s", config->name, profile->name);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 3) {
+        printf(" skipped (SCHED_FIFO not permitted)\n");
+    } else if (count == 0) {
+        printf(" no pets recorded\n");
+    } else {
+        qsort(margins, count, sizeof(long), compare_longs);
+        printf(" %7d %8ld %8ld %8ld %8ld %8ld %6d\n",
+               count,
+               margins[0],
+               percentile(margins, count, 0.1),
+               percentile(margins, count, 1),
+               percentile(margins, count, 5),
+               percentile(margins, count, 50),
+               missed);
+    }
+    fflush(stdout);
+    free(margins);
+}
+
+static int matches(const char *list, const char *name)
+{
+    if (!list)
+        return 1;
+
+    size_t len = strlen(name);
+    for (const char *p = list; (p = strstr(p, name)) != NULL; p += len) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: pet_jitter [options] <heart> <heart_fixture.so>\n"
+            "\n"
+            "Options:\n"
+            "  -d <seconds>  Duration of each run (default 60)\n"
+            "  -t <seconds>  Simulated WDT timeout (default 2)\n"
+            "  -p <list>     Load profiles: idle,cpu,memory,io,irq (default all)\n"
+            "  -c <list>     Scheduling configs: default,heart_fifo,pet_thread (default all)\n"
+            "  -m <MB>       Total memory for the memory profile (default half of RAM)\n"
+            "  -n <count>    Load processes per profile (default number of CPUs)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *profile_list = NULL;
+    const char *config_list = NULL;
+    int opt;
+
+    nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    memory_mb = sysconf(_SC_PHYS_PAGES) / 2 * (sysconf(_SC_PAGESIZE) / 1024) / 1024;
+
+    while ((opt = getopt(argc, argv, "d:t:p:c:m:n:")) != -1) {
+        switch (opt) {
+        case 'd': duration = atoi(optarg); break;
+        case 't': wdt_timeout = atoi(optarg); break;
+        case 'p': profile_list = optarg; break;
+        case 'c': config_list = optarg; break;
+        case 'm': memory_mb = atol(optarg); break;
+        case 'n': nprocs = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 2 || duration < 1 || wdt_timeout < 2 || nprocs < 1 || nprocs > MAX_LOAD_PROCS)
+        usage();
+
+    heart_path = argv[optind];
+    fixture_path = realpath(argv[optind + 1], NULL);
+    if (!fixture_path)
+        err(EXIT_FAILURE, "%s", argv[optind + 1]);
+
+    char report_path[64];
+    snprintf(report_path, sizeof(report_path), "/tmp/pet_jitter.%d.sock", getpid());
+
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("WDT timeout %ds, pet interval %ds, %ds per run, %d load processes\n",
+           wdt_timeout, pet_interval(wdt_timeout), duration, nprocs);
+    printf("Margins are in milliseconds. Lower is worse. Missed means the WDT fired.\n\n");
+    printf("%-12s %-8s %7s %8s %8s %8s %8s %8s %6s\n",
+           "config", "profile", "samples", "min", "p0.1", "p1", "p5", "p50", "missed");
+
+    for (const struct sched_config *config = configs; config->name; config++) {
+        if (!matches(config_list, config->name))
+            continue;
+
+        for (const struct load_profile *profile = profiles; profile->name; profile++) {
+            if (matches(profile_list, profile->name))
+                run(config, profile, report_path);
+        }
+    }
+    return 0;
+}
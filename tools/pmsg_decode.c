@@ -0,0 +1,373 @@
+// SPDX-FileCopyrightText: 2026 Frank Hunleth
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// Decode binary pmsg breadcrumbs
+//
+// When HEART_PMSG_FORMAT=binary, heart writes compact binary records to
+// /dev/pmsg0 instead of text. See src/elog.c for the format. The records only
+// have a hash of the printf format string, so this program needs the heart
+// executable that wrote them. It hashes every string in the executable to
+// find the formats and then prints the breadcrumbs like the text format does.
+//
+// Anything that isn't a binary record, like text from other pmsg writers, is
+// passed through unchanged.
+//
+// Usage: pmsg_decode <heart executable> [pmsg file]
+//
+// The pmsg file defaults to /sys/fs/pstore/pmsg-ramoops-0.
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PMSG_SYNC          0xfe
+#define MAX_RECORD_LEN     1024
+#define MIN_STRING_LEN     3
+#define PROGRAM_NAME       "nerves_heart"
+
+struct format {
+    uint16_t id;
+    int suffix; // 1 if this is the tail of a longer string in the executable
+    const char *str;
+};
+
+static struct format *formats = NULL;
+static size_t format_count = 0;
+
+static uint8_t *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        err(EXIT_FAILURE, "%s", path);
+
+    size_t capacity = 65536;
+    uint8_t *data = malloc(capacity);
+    *len = 0;
+    size_t n;
+    while ((n = fread(data + *len, 1, capacity - *len, fp)) > 0) {
+        *len += n;
+        if (*len == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity);
+        }
+    }
+    fclose(fp);
+    return data;
+}
+
+// Same as elog_event_id() in src/elog.c
+static uint16_t event_id(const char *fmt)
+{
+    uint32_t hash = 2166136261u;
+    while (*fmt) {
+        hash ^= (uint8_t) *fmt++;
+        hash *= 16777619u;
+    }
+    uint16_t id = (hash >> 16) ^ (hash & 0xffff);
+    return id != 0 ? id : 1;
+}
+
+static uint8_t crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc & 0x80) ? (uint8_t) ((crc << 1) ^ 0x07) : (uint8_t) (crc << 1);
+    }
+    return crc;
+}
+
+static void add_format(const char *str, int suffix)
+{
+    static size_t capacity = 0;
+    if (format_count == capacity) {
+        capacity = capacity ? capacity * 2 : 1024;
+        formats = realloc(formats, capacity * sizeof(struct format));
+    }
+    formats[format_count].id = event_id(str);
+    formats[format_count].suffix = suffix;
+    formats[format_count].str = str;
+    format_count++;
+}
+
+// Find all NUL-terminated printable strings. Linkers merge string literals
+// that are the tail of another one, so add every suffix too.
+static void load_formats(const char *path)
+{
+    size_t len;
+    uint8_t *data = read_file(path, &len);
+    size_t start = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = data[i];
+        if (c == '\0') {
+            if (i - start >= MIN_STRING_LEN) {
+                for (size_t j = start; j + MIN_STRING_LEN <= i; j++)
+                    add_format((const char *) &data[j], j != start);
+            }
+            start = i + 1;
+        } else if ((c < 0x20 || c > 0x7e) && c != '\t') {
+            start = i + 1;
+        }
+    }
+}
+
+struct reader {
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+};
+
+static int get_varint(struct reader *r, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->pos >= r->len)
+            return -1;
+        uint8_t b = r->data[r->pos++];
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+static int get_zigzag(struct reader *r, int64_t *v)
+{
+    uint64_t u;
+    if (get_varint(r, &u) < 0)
+        return -1;
+    *v = (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+    return 0;
+}
+
+static void append(char *out, size_t size, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void append(char *out, size_t size, const char *fmt, ...)
+{
+    size_t len = strlen(out);
+    if (len + 1 >= size)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(out + len, size - len, fmt, ap);
+    va_end(ap);
+}
+
+// Format the arguments in the same way that printf would have. Returns 0 only
+// if the arguments match the format exactly.
+static int format_args(const char *fmt, struct reader *r, char *out, size_t size)
+{
+    out[0] = '\0';
+
+    while (*fmt) {
+        if (*fmt != '%') {
+            const char *next = strchr(fmt, '%');
+            size_t len = next ? (size_t) (next - fmt) : strlen(fmt);
+            append(out, size, "%.*s", (int) len, fmt);
+            fmt += len;
+            continue;
+        }
+
+        // Rebuild the conversion specification with '*' replaced by values
+        char spec[32] = "%";
+        fmt++;
+        if (*fmt == '%') {
+            append(out, size, "%%");
+            fmt++;
+            continue;
+        }
+
+        size_t flags = strspn(fmt, "-+ #0'");
+        strncat(spec, fmt, flags);
+        fmt += flags;
+
+        for (int part = 0; part < 2; part++) {
+            if (part == 1) {
+                if (*fmt != '.')
+                    break;
+                strcat(spec, ".");
+                fmt++;
+            }
+            if (*fmt == '*') {
+                int64_t v;
+                if (get_zigzag(r, &v) < 0)
+                    return -1;
+                snprintf(spec + strlen(spec), sizeof(spec) - strlen(spec), "%d", (int) v);
+                fmt++;
+            } else {
+                size_t digits = strspn(fmt, "0123456789");
+                if (strlen(spec) + digits >= sizeof(spec) - 4)
+                    return -1;
+                strncat(spec, fmt, digits);
+                fmt += digits;
+            }
+        }
+
+        // Arguments were widened when encoded, so print them as the widest type
+        fmt += strspn(fmt, "hlzjt");
+        char conversion = *fmt++;
+        size_t spec_len = strlen(spec);
+        switch (conversion) {
+        case 'd':
+        case 'i': {
+            int64_t v;
+            if (get_zigzag(r, &v) < 0)
+                return -1;
+            snprintf(spec + spec_len, sizeof(spec) - spec_len, "ll%c", conversion);
+            append(out, size, spec, (long long) v);
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+        case 'p': {
+            uint64_t v;
+            if (get_varint(r, &v) < 0)
+                return -1;
+            if (conversion == 'c') {
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "c");
+                append(out, size, spec, (int) v);
+            } else if (conversion == 'p') {
+                append(out, size, "0x%" PRIx64, v);
+            } else {
+                snprintf(spec + spec_len, sizeof(spec) - spec_len, "ll%c", conversion);
+                append(out, size, spec, (unsigned long long) v);
+            }
+            break;
+        }
+        case 's': {
+            uint64_t len;
+            char str[MAX_RECORD_LEN];
+            if (get_varint(r, &len) < 0 || len > r->len - r->pos || len >= sizeof(str))
+                return -1;
+            memcpy(str, &r->data[r->pos], len);
+            str[len] = '\0';
+            r->pos += len;
+            snprintf(spec + spec_len, sizeof(spec) - spec_len, "s");
+            append(out, size, spec, str);
+            break;
+        }
+        default:
+            // Heart's encoder stops at unknown conversions
+            return r->pos == r->len ? 0 : -1;
+        }
+    }
+    return r->pos == r->len ? 0 : -1;
+}
+
+static void print_time(int have_time, uint64_t time_us, uint64_t relative_ms)
+{
+    if (!have_time) {
+        printf("+%" PRIu64 "ms ", relative_ms);
+        return;
+    }
+
+    time_t seconds = time_us / 1000000;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    printf("%04d-%02d-%02dT%02d:%02d:%02d.%06ld+00:00 ",
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec, (long) (time_us % 1000000));
+}
+
+// Try each format with a matching id. Prefer whole strings over suffixes.
+static void print_event(uint16_t id, struct reader *args)
+{
+    char out[MAX_RECORD_LEN * 4];
+
+    for (int suffix = 0; suffix < 2; suffix++) {
+        for (size_t i = 0; i < format_count; i++) {
+            if (formats[i].id != id || formats[i].suffix != suffix)
+                continue;
+
+            struct reader r = *args;
+            if (format_args(formats[i].str, &r, out, sizeof(out)) == 0) {
+                printf(PROGRAM_NAME " %s\n", out);
+                return;
+            }
+        }
+    }
+    printf(PROGRAM_NAME " unknown event 0x%04x with %zu bytes of arguments\n",
+           id, args->len - args->pos);
+}
+
+// Returns the length of the record at data[0] or 0 if it isn't one
+static size_t decode_record(const uint8_t *data, size_t len)
+{
+    static int have_time = 0;
+    static uint64_t time_us = 0;
+    static uint64_t relative_ms = 0;
+
+    struct reader r = { data, len, 1 };
+    uint64_t body_len;
+    if (get_varint(&r, &body_len) < 0 ||
+        body_len > MAX_RECORD_LEN ||
+        body_len + 1 > len - r.pos)
+        return 0;
+
+    const uint8_t *body = &data[r.pos];
+    if (crc8(body, body_len) != body[body_len])
+        return 0;
+
+    size_t record_len = r.pos + body_len + 1;
+    struct reader b = { body, body_len, 0 };
+    uint64_t id;
+    uint64_t delta_ms;
+    if (get_varint(&b, &id) < 0 || id > 0xffff || get_varint(&b, &delta_ms) < 0)
+        return 0;
+
+    if (id == 0) {
+        uint64_t seconds;
+        uint64_t useconds;
+        if (get_varint(&b, &seconds) < 0 || get_varint(&b, &useconds) < 0)
+            return 0;
+        have_time = 1;
+        time_us = seconds * 1000000 + useconds;
+        relative_ms = 0;
+        return record_len;
+    }
+
+    time_us += delta_ms * 1000;
+    relative_ms += delta_ms;
+    print_time(have_time, time_us, relative_ms);
+    print_event((uint16_t) id, &b);
+    return record_len;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: pmsg_decode <heart executable> [pmsg file]\n");
+        exit(EXIT_FAILURE);
+    }
+
+    load_formats(argv[1]);
+
+    size_t len;
+    uint8_t *data = read_file(argc == 3 ? argv[2] : "/sys/fs/pstore/pmsg-ramoops-0", &len);
+
+    for (size_t i = 0; i < len;) {
+        if (data[i] == PMSG_SYNC) {
+            size_t record_len = decode_record(&data[i], len - i);
+            if (record_len > 0) {
+                i += record_len;
+                continue;
+            }
+        }
+        putchar(data[i]);
+        i++;
+    }
+    return 0;
+}